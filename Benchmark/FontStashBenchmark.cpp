@@ -0,0 +1,182 @@
+﻿// Microbenchmarks of the text layout paths. Not part of the SysFontStash
+// project, build it on its own against FontStash.cpp with stb_truetype.h
+// and the Usagi headers on the include path, e.g.
+//
+//   g++ -std=c++17 -O2 -pthread -I<include paths>
+//       FontStashBenchmark.cpp ../FontStash.cpp -o FontStashBenchmark
+//
+// and run it with a font that has a kerning table:
+//
+//   FontStashBenchmark <font.ttf> [max threads]
+//
+// Measuring is timed with 0, 1, 2, 4, ... worker threads up to the given
+// count, which defaults to the hardware concurrency.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include "../FontStash.hpp"
+
+// not declared in FontStash.hpp
+int fons__tt_getGlyphIndex(FONSttFontImpl *font, int codepoint);
+int fons__tt_getGlyphKernAdvance(FONSttFontImpl *font, int glyph1, int glyph2);
+
+namespace
+{
+using Clock = std::chrono::steady_clock;
+
+std::string readFile(const char *path)
+{
+    std::ifstream in(path, std::ios::binary);
+    std::ostringstream out;
+    out << in.rdbuf();
+    return out.str();
+}
+
+double secondsSince(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// time per kerning pair of a latin line looked up in the font every time,
+// as text was kerned before the cache, and through the warm cache.
+void benchKerning(FONScontext &ctx, int font)
+{
+    const std::u32string text =
+        U"AVAST! To Tey, Wolf & LTA: \"Yo, VA.\" The quick brown fox "
+        U"jumps over the lazy dog; Typography, Kerning, Waves.";
+    const int passes = 20000;
+    FONSfont &f = ctx.fonts[font];
+    std::vector<int> glyphs;
+    float bounds[4];
+    // keeps the lookups from being optimized away
+    volatile int sum = 0;
+
+    // loads the font
+    ctx.getState()->font = font;
+    ctx.getState()->size = 18;
+    ctx.fonsTextBounds(0, 0, text, bounds);
+    for(auto &&c : text)
+        glyphs.push_back(fons__tt_getGlyphIndex(&f.font, c));
+
+    auto start = Clock::now();
+    for(int i = 0; i < passes; ++i)
+    {
+        for(size_t j = 1; j < glyphs.size(); ++j)
+        {
+            sum += fons__tt_getGlyphKernAdvance(&f.font,
+                glyphs[j - 1], glyphs[j]);
+        }
+    }
+    const double direct = secondsSince(start);
+
+    for(size_t j = 1; j < glyphs.size(); ++j)
+        f.fons__getKern(glyphs[j - 1], glyphs[j]);
+    start = Clock::now();
+    for(int i = 0; i < passes; ++i)
+    {
+        for(size_t j = 1; j < glyphs.size(); ++j)
+            sum += f.fons__getKern(glyphs[j - 1], glyphs[j]);
+    }
+    const double cached = secondsSince(start);
+
+    const double pairs = (double)passes * (glyphs.size() - 1);
+    printf("kerning: %.1f ns/pair from the font, %.1f ns/pair cached%s\n",
+        direct / pairs * 1e9, cached / pairs * 1e9,
+        f.hasKerning ? "" : " (font has no kerning)");
+}
+
+// strings per second measured one at a time with fonsTextBounds() and
+// all at once with fonsTextBoundsBatch() spread over the worker threads.
+// The glyph caches are warm, as they are for the labels of a UI redrawn
+// every frame.
+void benchMeasure(const std::string &data, int threads)
+{
+    const std::u32string words[] = {
+        U"Settings", U"Inventory", U"The quick brown fox", U"Quit",
+        U"jumps over the lazy dog", U"Health: 100/100", U"AVAST! Waves",
+        U"Level 12, Typography & Kerning"
+    };
+    const int count = 4096;
+    const int passes = 50;
+    std::vector<std::u32string> strings;
+    std::vector<FONSmeasureItem> items(count);
+    std::vector<float> bounds(count * 4), advances(count);
+
+    FONScontext ctx;
+    FONSparams params { };
+    params.width = 1024;
+    params.height = 1024;
+    params.flags = FONS_ZERO_TOPLEFT;
+    params.threads = threads;
+    ctx.init(params);
+    const int font = ctx.fonsAddFontMem("font", std::string(data));
+    ctx.getState()->font = font;
+    ctx.getState()->size = 18;
+
+    strings.reserve(count);
+    for(int i = 0; i < count; ++i)
+    {
+        strings.push_back(words[i % 8] + words[(i / 8) % 8]);
+        items[i] = { strings[i], ctx.getState() };
+    }
+    ctx.fonsTextBoundsBatch(items.data(), count, bounds.data(),
+        advances.data());
+
+    auto start = Clock::now();
+    for(int p = 0; p < passes; ++p)
+    {
+        for(int i = 0; i < count; ++i)
+        {
+            advances[i] = ctx.fonsTextBounds(0, 0, strings[i],
+                &bounds[i * 4]);
+        }
+    }
+    const double single = secondsSince(start);
+
+    start = Clock::now();
+    for(int p = 0; p < passes; ++p)
+    {
+        ctx.fonsTextBoundsBatch(items.data(), count, bounds.data(),
+            advances.data());
+    }
+    const double batch = secondsSince(start);
+
+    const double total = (double)passes * count;
+    printf("measure, %d threads: %.0f strings/s single, %.0f strings/s "
+        "batch\n", threads, total / single, total / batch);
+}
+}
+
+int main(int argc, char **argv)
+{
+    if(argc < 2)
+    {
+        fprintf(stderr, "usage: %s <font.ttf> [max threads]\n", argv[0]);
+        return 1;
+    }
+
+    FONScontext ctx;
+    FONSparams params { };
+    params.width = 1024;
+    params.height = 1024;
+    params.flags = FONS_ZERO_TOPLEFT;
+    ctx.init(params);
+    const std::string data = readFile(argv[1]);
+    const int font = ctx.fonsAddFontMem("font", std::string(data));
+
+    benchKerning(ctx, font);
+
+    const int maxThreads = argc > 2 ? atoi(argv[2]) :
+        (int)std::thread::hardware_concurrency();
+    benchMeasure(data, 0);
+    for(int threads = 1; threads <= maxThreads; threads *= 2)
+        benchMeasure(data, threads);
+
+    return 0;
+}
@@ -1,26 +1,38 @@
 #version 450 core
 
-layout(location = 0) in vec2 Position;
+layout(location = 0) in ivec2 Position;
 layout(location = 1) in vec2 TexCoord;
 layout(location = 2) in vec4 Color;
+layout(location = 3) in float Softness;
 
 layout(push_constant) uniform PushConstant {
     vec2 screenDimensions;
     vec2 scale;
     vec2 translate;
+    // pixels per vertex position unit, see fonsVertexScale()
+    float positionScale;
 } pc;
 
 
 layout(location = 0) out vec2 Frag_UV;
 layout(location = 1) out vec4 Frag_Color;
+layout(location = 2) flat out vec4 Frag_TexClamp;
+layout(location = 3) flat out vec4 Frag_Shadow;
+layout(location = 4) flat out vec4 Frag_ShadowColor;
+layout(location = 5) flat out float Frag_Softness;
 
 void main()
 {
     // Map to normalized clip coordinates:
-    vec2 xy = ((2.0 * (Position.xy - 0.5))
+    vec2 xy = ((2.0 * (vec2(Position.xy) * pc.positionScale - 0.5))
         / pc.screenDimensions.xy) - 1.0;
 
     Frag_UV = TexCoord;
     Frag_Color = Color;
+    // shadows are drawn as a softened copy beforehand
+    Frag_TexClamp = vec4(0, 0, 1, 1);
+    Frag_Shadow = vec4(0);
+    Frag_ShadowColor = vec4(0);
+    Frag_Softness = Softness;
     gl_Position = vec4(xy * pc.scale + pc.translate, 0, 1);
 }
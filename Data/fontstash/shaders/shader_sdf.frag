@@ -0,0 +1,40 @@
+#version 450 core
+
+layout(location = 0) in vec2 Frag_UV;
+layout(location = 1) in vec4 Frag_Color;
+layout(location = 2) flat in vec4 Frag_TexClamp;
+layout(location = 3) flat in vec4 Frag_Shadow;
+layout(location = 4) flat in vec4 Frag_ShadowColor;
+layout(location = 5) flat in float Frag_Softness;
+
+layout(set=0, binding=0) uniform sampler s;
+layout(set=0, binding=1) uniform texture2D t;
+
+layout(location = 0) out vec4 Out_Color;
+
+// Glyphs are signed distance fields with the outline at 0.5, see FONS_SDF.
+// Samples stay inside the glyph so the quad can grow to fit the shadow.
+float field(vec2 uv)
+{
+    uv = clamp(uv, Frag_TexClamp.xy, Frag_TexClamp.zw);
+    return texture(sampler2D(t, s), uv).a;
+}
+
+void main()
+{
+    float dist = field(Frag_UV);
+    // antialias over about one screen pixel at any scale, or blur
+    float width = fwidth(dist) * 0.5;
+    float edge = max(Frag_Softness, width);
+    float alpha = smoothstep(0.5 - edge, 0.5 + edge, dist) * Frag_Color.a;
+
+    // composite the shadow under the text
+    float soft = max(Frag_Shadow.z, width);
+    float shadow = smoothstep(0.5 - soft, 0.5 + soft,
+        field(Frag_UV - Frag_Shadow.xy)) * Frag_ShadowColor.a;
+    float under = shadow * (1.0 - alpha);
+    float total = alpha + under;
+
+    vec3 color = Frag_Color.rgb * alpha + Frag_ShadowColor.rgb * under;
+    Out_Color = vec4(color / max(total, 1e-5), total);
+}
@@ -0,0 +1,36 @@
+#version 450 core
+
+layout(location = 0) in vec2 Frag_UV;
+layout(location = 1) in vec4 Frag_Color;
+layout(location = 2) flat in vec4 Frag_TexClamp;
+layout(location = 3) flat in vec4 Frag_Shadow;
+layout(location = 4) flat in vec4 Frag_ShadowColor;
+layout(location = 5) flat in float Frag_Softness;
+
+layout(set=0, binding=0) uniform sampler s;
+layout(set=0, binding=1) uniform texture2D t;
+
+layout(location = 0) out vec4 Out_Color;
+
+// Bitmap glyphs keep a blurred copy of themselves for the shadow,
+// Frag_Shadow.w to the right of them. Samples stay inside the copy they are
+// read from so the quad can grow to fit the shadow.
+float coverage(vec2 uv, float channel)
+{
+    uv = clamp(uv, Frag_TexClamp.xy, Frag_TexClamp.zw);
+    return texture(sampler2D(t, s), uv + vec2(channel, 0)).a;
+}
+
+void main()
+{
+    float alpha = coverage(Frag_UV, 0.0) * Frag_Color.a;
+
+    // composite the shadow under the text
+    float shadow = coverage(Frag_UV - Frag_Shadow.xy, Frag_Shadow.w) *
+        Frag_ShadowColor.a;
+    float under = shadow * (1.0 - alpha);
+    float total = alpha + under;
+
+    vec3 color = Frag_Color.rgb * alpha + Frag_ShadowColor.rgb * under;
+    Out_Color = vec4(color / max(total, 1e-5), total);
+}
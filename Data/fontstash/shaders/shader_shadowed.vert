@@ -0,0 +1,50 @@
+#version 450 core
+
+// One instance per glyph with its shadow, see FONSshadowedGlyphInstance
+layout(location = 0) in vec4 Rect;
+layout(location = 1) in vec4 TexRect;
+layout(location = 2) in vec4 Color;
+layout(location = 3) in float Softness;
+layout(location = 4) in vec4 TexClamp;
+layout(location = 5) in vec4 Shadow;
+layout(location = 6) in vec4 ShadowColor;
+
+layout(push_constant) uniform PushConstant {
+    vec2 screenDimensions;
+    vec2 scale;
+    vec2 translate;
+    // unused, instances keep float positions
+    float positionScale;
+} pc;
+
+
+layout(location = 0) out vec2 Frag_UV;
+layout(location = 1) out vec4 Frag_Color;
+layout(location = 2) flat out vec4 Frag_TexClamp;
+layout(location = 3) flat out vec4 Frag_Shadow;
+layout(location = 4) flat out vec4 Frag_ShadowColor;
+layout(location = 5) flat out float Frag_Softness;
+
+// Same triangle order as FONScontext::quad()
+const vec2 corners[6] = vec2[](
+    vec2(0, 0), vec2(1, 1), vec2(1, 0),
+    vec2(0, 0), vec2(0, 1), vec2(1, 1)
+);
+
+void main()
+{
+    vec2 corner = corners[gl_VertexIndex];
+    vec2 Position = mix(Rect.xy, Rect.zw, corner);
+
+    // Map to normalized clip coordinates:
+    vec2 xy = ((2.0 * (Position.xy - 0.5))
+        / pc.screenDimensions.xy) - 1.0;
+
+    Frag_UV = mix(TexRect.xy, TexRect.zw, corner);
+    Frag_Color = Color;
+    Frag_TexClamp = TexClamp;
+    Frag_Shadow = Shadow;
+    Frag_ShadowColor = ShadowColor;
+    Frag_Softness = Softness;
+    gl_Position = vec4(xy * pc.scale + pc.translate, 0, 1);
+}
@@ -0,0 +1,156 @@
+﻿#include "FontAtlasAssetConverter.hpp"
+
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+#include <Usagi/Asset/AssetRoot.hpp>
+#include <Usagi/Core/Exception.hpp>
+
+#include "FontStash.hpp"
+
+namespace usagi
+{
+namespace
+{
+constexpr int BAKED_ATLAS_SIZE = 2048;
+
+constexpr char32_t MAX_CODEPOINT = 0x10ffff;
+
+unsigned long long parseCodepoint(const std::string &str)
+{
+    return std::stoull(str, nullptr, 0);
+}
+
+void appendUtf8(std::u32string &out, const std::string &str)
+{
+    // smallest codepoint of each sequence length, shorter encodings of
+    // it are overlong
+    static constexpr char32_t MIN_CODEPOINT[] = { 0, 0, 0x80, 0x800, 0x10000 };
+
+    for(std::size_t i = 0; i < str.size();)
+    {
+        const auto c = (unsigned char)str[i];
+        const int n = c < 0x80 ? 1 : c < 0xc0 ? 0 :
+            c < 0xe0 ? 2 : c < 0xf0 ? 3 : c < 0xf8 ? 4 : 0;
+        if(n == 0)
+            USAGI_THROW(std::runtime_error("invalid utf-8 in manifest"));
+        if(i + n > str.size())
+            USAGI_THROW(std::runtime_error("truncated utf-8 in manifest"));
+        char32_t cp = n == 1 ? c : c & (0x3f >> (n - 1));
+        for(int j = 1; j < n; ++j)
+        {
+            const auto cont = (unsigned char)str[i + j];
+            if((cont & 0xc0) != 0x80)
+                USAGI_THROW(std::runtime_error("invalid utf-8 in manifest"));
+            cp = cp << 6 | (cont & 0x3f);
+        }
+        if(cp < MIN_CODEPOINT[n] || cp > MAX_CODEPOINT ||
+            (cp >= 0xd800 && cp <= 0xdfff))
+            USAGI_THROW(std::runtime_error("invalid utf-8 in manifest"));
+        out.push_back(cp);
+        i += n;
+    }
+}
+}
+
+std::shared_ptr<std::string> RawAssetConverter::operator()(
+    AssetRoot * /* assets */,
+    const std::string &data)
+{
+    return std::make_shared<std::string>(data);
+}
+
+std::shared_ptr<std::string> FontAtlasAssetConverter::operator()(
+    AssetRoot *assets,
+    const std::string &manifest)
+{
+    FONSparams params { };
+    std::vector<std::string> fonts;
+    std::vector<float> sizes, blurs;
+    std::u32string chars;
+    std::istringstream lines(manifest);
+    std::string line, directive;
+
+    params.width = BAKED_ATLAS_SIZE;
+    params.height = BAKED_ATLAS_SIZE;
+    params.flags = FONS_ZERO_TOPLEFT;
+    params.threads = std::max(
+        (int)std::thread::hardware_concurrency() - 1, 0);
+
+    while(std::getline(lines, line))
+    {
+        std::istringstream args(line);
+        if(!(args >> directive) || directive[0] == '#')
+            continue;
+        if(directive == "atlas")
+        {
+            args >> params.width >> params.height;
+        }
+        else if(directive == "sdf")
+        {
+            params.flags |= FONS_SDF;
+        }
+        else if(directive == "font")
+        {
+            std::string locator;
+            args >> locator;
+            fonts.push_back(std::move(locator));
+        }
+        else if(directive == "size")
+        {
+            for(float v; args >> v;)
+                sizes.push_back(v);
+        }
+        else if(directive == "blur")
+        {
+            for(float v; args >> v;)
+                blurs.push_back(v);
+        }
+        else if(directive == "range")
+        {
+            std::string first, last;
+            args >> first >> last;
+            // the counter is wider than char32_t so that it cannot wrap
+            const auto begin = parseCodepoint(first);
+            const auto end = std::min<unsigned long long>(
+                parseCodepoint(last), MAX_CODEPOINT);
+            if(begin > end)
+                USAGI_THROW(std::runtime_error(
+                    "empty codepoint range in manifest: " + line));
+            for(auto c = begin; c <= end; ++c)
+                chars.push_back((char32_t)c);
+        }
+        else if(directive == "chars")
+        {
+            std::string text;
+            std::getline(args >> std::ws, text);
+            appendUtf8(chars, text);
+        }
+        else
+        {
+            USAGI_THROW(std::runtime_error(
+                "unknown font atlas directive: " + directive));
+        }
+    }
+    if(fonts.empty())
+        USAGI_THROW(std::runtime_error("font atlas manifest has no font"));
+    if(blurs.empty())
+        blurs.push_back(0);
+
+    // no renderResize, running out of space throws instead of growing.
+    // the context is only created here because its destructor expects
+    // init() to have run.
+    FONScontext context;
+    context.init(params);
+    for(auto &&locator : fonts)
+    {
+        const auto data = assets->res<RawAssetConverter>(locator);
+        const int font = context.fonsAddFontMem(locator, *data);
+        if(font > 0)
+            context.addFallbackFont(0, font);
+    }
+    context.fonsPrewarm(0, sizes, blurs, chars);
+
+    return std::make_shared<std::string>(context.fonsSaveCacheMem());
+}
+}
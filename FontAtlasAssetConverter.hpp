@@ -0,0 +1,46 @@
+﻿#pragma once
+
+#include <memory>
+#include <string>
+
+#include <Usagi/Asset/Decoder/StringAssetDecoder.hpp>
+
+namespace usagi
+{
+class AssetRoot;
+
+// passes the bytes of an asset through unchanged
+class RawAssetConverter
+{
+public:
+    using DefaultDecoder = StringAssetDecoder;
+
+    std::shared_ptr<std::string> operator()(
+        AssetRoot *assets,
+        const std::string &data);
+};
+
+// bakes the glyphs listed in a manifest into an atlas cache that
+// FONScontext::fonsLoadBase() loads without rasterizing anything. the
+// manifest has one directive per line, # starts a comment:
+//
+//   atlas <width> <height>  size of the baked layer, defaults to 2048
+//   sdf                     bake distance fields, must match the runtime
+//   font <locator>          the first font is the one drawn with, the
+//                           following ones are its fallbacks
+//   size <size>...          pixel sizes
+//   blur <blur>...          blur radii, defaults to 0
+//   range <first> <last>    inclusive codepoints, decimal or 0x hex
+//   chars <text>            utf-8 characters
+//
+// baking fails if the glyphs do not fit into the layer.
+class FontAtlasAssetConverter
+{
+public:
+    using DefaultDecoder = StringAssetDecoder;
+
+    std::shared_ptr<std::string> operator()(
+        AssetRoot *assets,
+        const std::string &manifest);
+};
+}
@@ -2,12 +2,56 @@
 
 #include <stdio.h>
 #include <math.h>
+#include <limits.h>
 #include <stdexcept>
-#include <Usagi/Utility/File.hpp>
+#include <atomic>
+#include <chrono>
+#include <unordered_set>
+#include <fstream>
+#include <sstream>
+#ifdef _WIN32
+#	ifndef WIN32_LEAN_AND_MEAN
+#		define WIN32_LEAN_AND_MEAN
+#	endif
+#	ifndef NOMINMAX
+#		define NOMINMAX
+#	endif
+#	include <windows.h>
+#else
+#	include <sys/mman.h>
+#	include <sys/stat.h>
+#	include <fcntl.h>
+#	include <unistd.h>
+#endif
 #include <Usagi/Math/Lerp.hpp>
 #include <Usagi/Core/Exception.hpp>
 
 #define FONS_NOTUSED(v)  (void)sizeof(v)
+#define FONS_KERN_UNKNOWN SHRT_MIN
+// Set in the blur key of bitmap glyphs that carry a blurred copy of
+// themselves for their shadow, the shadow channel. The low byte holds the
+// blur of the glyph, the next one the blur of the channel.
+#define FONS_SHADOW_CHANNEL 0x4000
+// Bump when the layout of the atlas cache or anything stored in it
+// changes.
+#define FONS_CACHE_MAGIC "FONSATLS"
+#define FONS_CACHE_VERSION 4
+
+// Vectorized blur, define FONS_NO_SIMD to use the scalar code only.
+#ifndef FONS_NO_SIMD
+#	if defined(__SSE2__) || defined(_M_X64) || \
+        (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#		define FONS_SIMD_SSE2
+#		include <emmintrin.h>
+#		ifdef __AVX2__
+#			define FONS_SIMD_AVX2
+#			include <immintrin.h>
+#		endif
+#	elif defined(__ARM_NEON) || defined(_M_ARM64)
+#		define FONS_SIMD_NEON
+#		include <arm_neon.h>
+#	endif
+#endif
 
 #ifdef FONS_USE_FREETYPE
 
@@ -23,7 +67,7 @@ typedef struct FONSttFontImpl FONSttFontImpl;
 
 FT_Library ftLibrary;
 
-int fons__tt_init()
+int fons__tt_init(FONScontext *context)
 {
     FT_Error ftError;
     FONS_NOTUSED(context);
@@ -58,6 +102,16 @@ int fons__tt_getGlyphIndex(FONSttFontImpl *font, int codepoint)
     return FT_Get_Char_Index(font->font, codepoint);
 }
 
+void fons__tt_getGlyphIndices(
+    FONSttFontImpl *font,
+    int first,
+    int count,
+    unsigned short *indices)
+{
+    for(int i = 0; i < count; ++i)
+        indices[i] = (unsigned short)FT_Get_Char_Index(font->font, first + i);
+}
+
 int fons__tt_buildGlyphBitmap(FONSttFontImpl *font, int glyph, float size, float scale,
     int *advance, int *lsb, int *x0, int *y0, int *x1, int *y1)
 {
@@ -101,11 +155,37 @@ void fons__tt_renderGlyphBitmap(FONSttFontImpl *font, unsigned char *output, int
     }
 }
 
+int fons__tt_renderGlyphSDF(FONSttFontImpl *font, unsigned char *output, int outWidth, int outHeight, int outStride,
+    float scale, int glyph)
+{
+    // Not supported.
+    FONS_NOTUSED(font);
+    FONS_NOTUSED(output);
+    FONS_NOTUSED(outWidth);
+    FONS_NOTUSED(outHeight);
+    FONS_NOTUSED(outStride);
+    FONS_NOTUSED(scale);
+    FONS_NOTUSED(glyph);
+    return 0;
+}
+
+int fons__tt_canRenderSDF()
+{
+    return 0;
+}
+
+int fons__tt_hasKerning(FONSttFontImpl *font)
+{
+    return FT_HAS_KERNING(font->font);
+}
+
 int fons__tt_getGlyphKernAdvance(FONSttFontImpl *font, int glyph1, int glyph2)
 {
     FT_Vector ftKerning;
-    FT_Get_Kerning(font->font, glyph1, glyph2, FT_KERNING_DEFAULT, &ftKerning);
-    return (int)((ftKerning.x + 32) >> 6);  // Round up and convert to integer
+    // Font units like the stb backend, they are cached for every size and
+    // scaled by the caller.
+    FT_Get_Kerning(font->font, glyph1, glyph2, FT_KERNING_UNSCALED, &ftKerning);
+    return (int)ftKerning.x;
 }
 
 #else
@@ -120,6 +200,11 @@ int fons__tt_init(FONScontext *context)
     return 1;
 }
 
+int fons__tt_canRenderSDF()
+{
+    return 1;
+}
+
 int fons__tt_loadFont(
     FONScontext *context,
     FONSttFontImpl *font,
@@ -153,6 +238,61 @@ int fons__tt_getGlyphIndex(FONSttFontImpl *font, int codepoint)
     return stbtt_FindGlyphIndex(&font->font, codepoint);
 }
 
+static int fons__readU16(const unsigned char *p)
+{
+    return p[0] << 8 | p[1];
+}
+
+void fons__tt_getGlyphIndices(
+    FONSttFontImpl *font,
+    int first,
+    int count,
+    unsigned short *indices)
+{
+    const unsigned char *data = font->font.data;
+    const unsigned char *ends, *starts, *deltas, *offsets;
+    const int map = font->font.index_map;
+    int i, c, g, segCount, start, end, last, delta, offset;
+
+    if(map == 0 || fons__readU16(data + map) != 4)
+    {
+        for(i = 0; i < count; ++i)
+        {
+            indices[i] = (unsigned short)stbtt_FindGlyphIndex(&font->font,
+                first + i);
+        }
+        return;
+    }
+
+    // stbtt_FindGlyphIndex() searches the segments of format 4 cmaps for
+    // every codepoint, walk the ones overlapping the range once instead.
+    // Glyphs are looked up the same way it does.
+    memset(indices, 0, count * sizeof(unsigned short));
+    last = first + count - 1;
+    segCount = fons__readU16(data + map + 6) >> 1;
+    ends = data + map + 14;
+    starts = ends + segCount * 2 + 2;
+    deltas = starts + segCount * 2;
+    offsets = deltas + segCount * 2;
+    for(i = 0; i < segCount; ++i)
+    {
+        end = fons__readU16(ends + i * 2);
+        if(end < first) continue;
+        start = fons__readU16(starts + i * 2);
+        if(start > last) break;
+        delta = fons__readU16(deltas + i * 2);
+        offset = fons__readU16(offsets + i * 2);
+        for(c = std::max(start, first); c <= std::min(end, last); ++c)
+        {
+            if(offset == 0)
+                g = c + delta;
+            else
+                g = fons__readU16(offsets + i * 2 + offset + (c - start) * 2);
+            indices[c - first] = (unsigned short)g;
+        }
+    }
+}
+
 int fons__tt_buildGlyphBitmap(
     FONSttFontImpl *font,
     int glyph,
@@ -185,6 +325,39 @@ void fons__tt_renderGlyphBitmap(
         scaleX, scaleY, glyph);
 }
 
+int fons__tt_renderGlyphSDF(
+    FONSttFontImpl *font,
+    unsigned char *output,
+    int outWidth,
+    int outHeight,
+    int outStride,
+    float scale,
+    int glyph)
+{
+    int w, h, xoff, yoff, y;
+    unsigned char *sdf = stbtt_GetGlyphSDF(&font->font, scale, glyph,
+        FONS_SDF_PADDING, 128, 128.0f / FONS_SDF_PADDING,
+        &w, &h, &xoff, &yoff);
+
+    // Empty glyphs have no field.
+    if(sdf == NULL)
+        return 1;
+    // The field covers the bitmap box plus the padding, which is what
+    // was allocated for it.
+    for(y = 0; y < h && y < outHeight; y++)
+    {
+        memcpy(&output[y * outStride], &sdf[y * w],
+            w < outWidth ? w : outWidth);
+    }
+    stbtt_FreeSDF(sdf, font->font.userdata);
+    return 1;
+}
+
+int fons__tt_hasKerning(FONSttFontImpl *font)
+{
+    return font->font.kern != 0 || font->font.gpos != 0;
+}
+
 int fons__tt_getGlyphKernAdvance(FONSttFontImpl *font, int glyph1, int glyph2)
 {
     return stbtt_GetGlyphKernAdvance(&font->font, glyph1, glyph2);
@@ -204,6 +377,13 @@ unsigned int fons__hashint(unsigned int a)
     return a;
 }
 
+unsigned int fons__hashglyph(unsigned int index, short size, short blur)
+{
+    return fons__hashint(index ^ fons__hashint(
+        (unsigned int)(unsigned short)size |
+        (unsigned int)(unsigned short)blur << 16));
+}
+
 int fons__mini(int a, int b)
 {
     return a < b ? a : b;
@@ -214,19 +394,320 @@ int fons__maxi(int a, int b)
     return a > b ? a : b;
 }
 
+float fons__clampf(float v, float lo, float hi)
+{
+    return v < lo ? lo : (v > hi ? hi : v);
+}
+
+// Edge softness in distance field units for a blur in pixels, on a field
+// drawn at k times its size. The field spans FONS_SDF_PADDING pixels on
+// each side of the edge.
+float fons__sdfSoftness(float blur, float k)
+{
+    return blur / k * (128.0f / FONS_SDF_PADDING) / 255.0f;
+}
+
+unsigned short fons__unorm16(float v)
+{
+    return (unsigned short)(fons__clampf(v, 0, 1) * USHRT_MAX + 0.5f);
+}
+
+// Blur key of a bitmap glyph with a shadow channel blurred by shadowBlur
+// pixels. Both blurs are clamped like those of plain glyphs.
+short fons__shadowKey(short iblur, float shadowBlur)
+{
+    const int blur = fons__mini(fons__maxi(iblur, 0), 20);
+    const int shadow = (int)fons__clampf(shadowBlur, 0, 20);
+    return (short)(FONS_SHADOW_CHANNEL | shadow << 8 | blur);
+}
+
+// Number of bitmaps side by side in the rect of a glyph with the blur key.
+int fons__glyphChannels(short iblur)
+{
+    return iblur > 0 && (iblur & FONS_SHADOW_CHANNEL) ? 2 : 1;
+}
+
+int fons__textBlur(short iblur)
+{
+    return fons__glyphChannels(iblur) > 1 ? iblur & 0xff : iblur;
+}
+
+int fons__shadowBlur(short iblur)
+{
+    return fons__glyphChannels(iblur) > 1 ? iblur >> 8 & 0x3f : 0;
+}
+
+// Width of the glyph bitmap without its shadow channel.
+int fons__glyphWidth(const FONSglyph *glyph)
+{
+    return (glyph->x1 - glyph->x0) / fons__glyphChannels(glyph->blur);
+}
+
 // Atlas based on Skyline Bin Packer by Jukka Jylänki
 
 
-void FONScontext::fons__allocAtlas(int w, int h)
+void FONScontext::fons__buildPages(int w, int h)
 {
-    atlas.width = w;
-    atlas.height = h;
+    // Layers are paged as a whole.
+    const int pageHeight =
+        params.atlasBudget > 0 && params.renderAddPage == NULL ?
+        FONS_ATLAS_PAGE_HEIGHT : h;
 
-    // Init root node.
-    atlas.nodes.emplace_back();
-    atlas.nodes[0].x = 0;
-    atlas.nodes[0].y = 0;
-    atlas.nodes[0].width = (short)w;
+    pages.clear();
+    for(int y = 0; y < h; y += pageHeight)
+    {
+        FONSatlasPage &page = pages.emplace_back();
+        page.atlas.fons__atlasReset(w, fons__mini(pageHeight, h - y));
+        page.layer = 0;
+        page.y = y;
+        page.lastUsed = INT_MIN;
+    }
+}
+
+int FONScontext::fons__maxAtlasHeight(int w)
+{
+    const int rows = params.atlasBudget / w;
+    return fons__maxi(rows - rows % FONS_ATLAS_PAGE_HEIGHT,
+        FONS_ATLAS_PAGE_HEIGHT);
+}
+
+int FONScontext::fons__clampAtlasHeight(int w, int h)
+{
+    if(params.atlasBudget <= 0 || params.renderAddPage != NULL)
+        return h;
+    h = fons__mini(h, fons__maxAtlasHeight(w));
+    h -= h % FONS_ATLAS_PAGE_HEIGHT;
+    return fons__maxi(h, FONS_ATLAS_PAGE_HEIGHT);
+}
+
+int FONScontext::fons__rectFitsPage(int w, int h)
+{
+    if(w > params.width)
+        return 0;
+    // Without a budget the atlas keeps growing in height.
+    if(params.atlasBudget <= 0)
+        return 1;
+    // Bands are merged for taller rects, up to the whole budget.
+    return h <= (params.renderAddPage != NULL ?
+        params.height : fons__maxAtlasHeight(params.width));
+}
+
+int FONScontext::fons__allocRect(int w, int h, int *x, int *y, int *page)
+{
+    int i, first, merged;
+
+    for(i = 0; i < (int)pages.size(); ++i)
+    {
+        if(pages[i].atlas.fons__atlasAddRect(w, h, x, y))
+            break;
+    }
+    if(i == (int)pages.size())
+    {
+        if(params.renderAddPage == NULL && params.atlasBudget > 0 &&
+            h > FONS_ATLAS_PAGE_HEIGHT)
+        {
+            // Taller than a band, make room over several. Growing first
+            // gives fresh bands that can be merged at once.
+            if(params.height < fons__maxAtlasHeight(params.width))
+                fonsExpandAtlas(params.width, params.height * 2);
+            merged = fons__mergePages(h, &first);
+            if(merged != 1)
+                return merged;
+        }
+        else if(params.renderAddPage != NULL && fons__addPage())
+        {
+            // Existing layers stay where they are.
+            first = (int)pages.size() - 1;
+        }
+        else if(params.renderAddPage == NULL && params.atlasBudget <= 0)
+        {
+            // Atlas is full, let the user to resize the atlas (or not), and try again.
+            // handleError(errorUptr, FONS_ATLAS_FULL, 0);
+            fonsExpandAtlas(params.width, params.height * 2);
+            first = 0;
+        }
+        else if(params.renderAddPage == NULL &&
+            params.height < fons__maxAtlasHeight(params.width))
+        {
+            first = (int)pages.size();
+            fonsExpandAtlas(params.width, params.height * 2);
+        }
+        else
+        {
+            // Out of budget, reuse the least recently used page. Pinned
+            // pages stay, and so do pages the GPU may still sample. Bands
+            // merged into the page before them have no rows left.
+            first = -1;
+            for(i = 0; i < (int)pages.size(); ++i)
+            {
+                if(!pages[i].pinned && pages[i].atlas.height > 0 &&
+                    (first == -1 ||
+                    pages[i].lastUsed < pages[first].lastUsed))
+                    first = i;
+            }
+            if(first == -1)
+                return 0;
+            if(params.framesInFlight > 0 &&
+                pages[first].lastUsed >= frame - params.framesInFlight)
+                return 0;
+            fons__evictPage(first);
+        }
+        for(i = first; i < (int)pages.size(); ++i)
+        {
+            if(pages[i].atlas.fons__atlasAddRect(w, h, x, y))
+                break;
+        }
+        if(i == (int)pages.size())
+            return 0;
+    }
+
+    *y += pages[i].y;
+    *page = i;
+    return 1;
+}
+
+int FONScontext::fons__mergePages(int h, int *page)
+{
+    int i, j, height, newest, best = -1, bestEnd = 0, bestNewest = 0;
+    int blocked = 0;
+
+    // Bands are in order of their rows.
+    for(i = 0; i < (int)pages.size(); ++i)
+    {
+        if(pages[i].atlas.height == 0)
+            continue;
+        height = 0;
+        newest = INT_MIN;
+        for(j = i; j < (int)pages.size() && height < h; ++j)
+        {
+            if(pages[j].pinned || pages[j].y != pages[i].y + height)
+                break;
+            height += pages[j].atlas.height;
+            newest = fons__maxi(newest, pages[j].lastUsed);
+        }
+        if(height < h)
+            continue;
+        if(params.framesInFlight > 0 &&
+            newest >= frame - params.framesInFlight)
+        {
+            blocked = 1;
+            continue;
+        }
+        if(best == -1 || newest < bestNewest)
+        {
+            best = i;
+            bestEnd = j;
+            bestNewest = newest;
+        }
+    }
+    if(best == -1)
+        return blocked ? 0 : -1;
+
+    height = 0;
+    for(j = best; j < bestEnd; ++j)
+    {
+        fons__evictPage(j);
+        height += pages[j].atlas.height;
+    }
+    // The first band takes the rows of the others, which keep their
+    // index with no rows left.
+    pages[best].atlas.fons__atlasReset(params.width, height);
+    for(j = best + 1; j < bestEnd; ++j)
+    {
+        pages[j].atlas.fons__atlasReset(params.width, 0);
+        pages[j].y = pages[best].y + height;
+    }
+    if(best == 0)
+        fons__addWhiteRect(2, 2);
+
+    *page = best;
+    return 1;
+}
+
+int FONScontext::fons__addPage()
+{
+    const int layer = (int)texData.size();
+    const int layerSize = params.width * params.height;
+
+    if(params.atlasBudget > 0 &&
+        (long long)(layer + 1) * layerSize > params.atlasBudget)
+        return 0;
+    if(params.renderAddPage(params.userPtr, layer) == 0)
+        return 0;
+
+    texData.emplace_back(new unsigned char[layerSize]);
+    memset(texData.back().get(), 0, layerSize);
+    dirtyTiles.resize(dirtyTiles.size() + dirtyTilesX * dirtyTilesY, 0);
+
+    FONSatlasPage &page = pages.emplace_back();
+    page.atlas.fons__atlasReset(params.width, params.height);
+    page.layer = layer;
+    page.y = 0;
+    page.lastUsed = INT_MIN;
+
+    return 1;
+}
+
+void FONScontext::fons__evictPage(int i)
+{
+    int j, k;
+
+    // Pending quads may still sample the page.
+    flush();
+
+    FONSatlasPage &page = pages[i];
+    page.atlas.fons__atlasReset(page.atlas.width, page.atlas.height);
+    page.lastUsed = frame;
+    // Glyphs expect zeroed padding around them. Only the rects of new
+    // glyphs are uploaded, the rest of the page is never sampled.
+    memset(&texData[page.layer][page.y * params.width], 0,
+        page.atlas.height * params.width);
+
+    // Drop the glyphs that lived in the page.
+    for(j = 0; j < (int)fonts.size(); j++)
+    {
+        FONSfont *font = &fonts[j];
+        font->glyphs.erase(
+            std::remove_if(font->glyphs.begin(), font->glyphs.end(),
+                [=](const FONSglyph &g) { return g.page == i; }),
+            font->glyphs.end());
+        font->lut.fons__tableClear();
+        for(k = 0; k < (int)font->glyphs.size(); k++)
+        {
+            const FONSglyph &g = font->glyphs[k];
+            font->lut.fons__tableInsert({ (unsigned)g.index, g.size, g.blur }, k);
+        }
+    }
+    ++atlasGeneration;
+
+    if(i == 0)
+        fons__addWhiteRect(2, 2);
+}
+
+void FONScontext::fons__touchPage(int page)
+{
+    pages[page].lastUsed = frame;
+    if(pageLog)
+        pageLog->push_back((short)page);
+}
+
+void FONScontext::fonsNextFrame()
+{
+    int i;
+
+    ++frame;
+    lastFrameUploadedBytes = frameUploadedBytes;
+    frameUploadedBytes = 0;
+
+    if(!blockedGlyphs.empty())
+    {
+        glyphJobs.swap(blockedGlyphs);
+        for(i = 0; i < (int)glyphJobs.size(); i++)
+            fons__storeGlyph(&glyphJobs[i]);
+        glyphJobs.clear();
+        // Layouts recorded while the glyphs were missing are stale.
+        ++atlasGeneration;
+    }
 }
 
 int FONSatlas::fons__atlasInsertNode(int idx, int x, int y, int w)
@@ -378,11 +859,11 @@ void FONScontext::fons__addWhiteRect(int w, int h)
 {
     int x, y, gx, gy;
     unsigned char *dst;
-    if(atlas.fons__atlasAddRect(w, h, &gx, &gy) == 0)
+    if(pages[0].atlas.fons__atlasAddRect(w, h, &gx, &gy) == 0)
         return;
 
     // Rasterize
-    dst = &texData[gx + gy * params.width];
+    dst = &texData[0][gx + gy * params.width];
     for(y = 0; y < h; y++)
     {
         for(x = 0; x < w; x++)
@@ -390,10 +871,100 @@ void FONScontext::fons__addWhiteRect(int w, int h)
         dst += params.width;
     }
 
-    dirtyRect[0] = fons__mini(dirtyRect[0], gx);
-    dirtyRect[1] = fons__mini(dirtyRect[1], gy);
-    dirtyRect[2] = fons__maxi(dirtyRect[2], gx + w);
-    dirtyRect[3] = fons__maxi(dirtyRect[3], gy + h);
+    fons__markDirty(0, gx, gy, gx + w, gy + h);
+}
+
+void FONScontext::fons__markDirty(int layer, int x0, int y0, int x1, int y1)
+{
+    int tx, ty;
+    unsigned char *tiles = &dirtyTiles[layer * dirtyTilesX * dirtyTilesY];
+
+    // The bounding rect spans all layers.
+    dirtyRect[0] = fons__mini(dirtyRect[0], x0);
+    dirtyRect[1] = fons__mini(dirtyRect[1], y0);
+    dirtyRect[2] = fons__maxi(dirtyRect[2], x1);
+    dirtyRect[3] = fons__maxi(dirtyRect[3], y1);
+
+    for(ty = y0 / FONS_DIRTY_TILE_SIZE;
+        ty <= (y1 - 1) / FONS_DIRTY_TILE_SIZE; ++ty)
+    {
+        for(tx = x0 / FONS_DIRTY_TILE_SIZE;
+            tx <= (x1 - 1) / FONS_DIRTY_TILE_SIZE; ++tx)
+            tiles[tx + ty * dirtyTilesX] = 1;
+    }
+}
+
+void FONScontext::fons__resetDirty()
+{
+    dirtyRect[0] = params.width;
+    dirtyRect[1] = params.height;
+    dirtyRect[2] = 0;
+    dirtyRect[3] = 0;
+
+    dirtyTilesX = (params.width + FONS_DIRTY_TILE_SIZE - 1) /
+        FONS_DIRTY_TILE_SIZE;
+    dirtyTilesY = (params.height + FONS_DIRTY_TILE_SIZE - 1) /
+        FONS_DIRTY_TILE_SIZE;
+    dirtyTiles.assign(texData.size() * dirtyTilesX * dirtyTilesY, 0);
+}
+
+int FONScontext::fons__collectDirtyRects(int layer)
+{
+    int tx, ty, i;
+    const unsigned char *tiles =
+        &dirtyTiles[layer * dirtyTilesX * dirtyTilesY];
+
+    dirtyRects.clear();
+
+    // Merge dirty tiles into horizontal runs, and runs into the rect from
+    // the row above when they span the same columns.
+    for(ty = 0; ty < dirtyTilesY; ++ty)
+    {
+        const int y0 = ty * FONS_DIRTY_TILE_SIZE;
+        const int count = (int)dirtyRects.size();
+
+        for(tx = 0; tx < dirtyTilesX; )
+        {
+            int run = tx;
+            if(!tiles[tx + ty * dirtyTilesX])
+            {
+                ++tx;
+                continue;
+            }
+            while(run < dirtyTilesX && tiles[run + ty * dirtyTilesX])
+                ++run;
+
+            const int x0 = tx * FONS_DIRTY_TILE_SIZE;
+            const int x1 = run * FONS_DIRTY_TILE_SIZE;
+            for(i = 0; i < count; i += 4)
+            {
+                if(dirtyRects[i] == x0 && dirtyRects[i + 2] == x1 &&
+                    dirtyRects[i + 3] == y0)
+                    break;
+            }
+            if(i < count)
+            {
+                dirtyRects[i + 3] = y0 + FONS_DIRTY_TILE_SIZE;
+            }
+            else
+            {
+                dirtyRects.push_back(x0);
+                dirtyRects.push_back(y0);
+                dirtyRects.push_back(x1);
+                dirtyRects.push_back(y0 + FONS_DIRTY_TILE_SIZE);
+            }
+            tx = run;
+        }
+    }
+
+    // Clip the last row and column of tiles to the atlas.
+    for(i = 0; i < (int)dirtyRects.size(); i += 4)
+    {
+        dirtyRects[i + 2] = fons__mini(dirtyRects[i + 2], params.width);
+        dirtyRects[i + 3] = fons__mini(dirtyRects[i + 3], params.height);
+    }
+
+    return (int)dirtyRects.size() / 4;
 }
 
 void FONScontext::init(FONSparams params_)
@@ -403,6 +974,16 @@ void FONScontext::init(FONSparams params_)
     // Initialize implementation library
     if(!fons__tt_init(this)) USAGI_THROW(std::runtime_error("init failed"));
 
+    if((params.flags & FONS_SDF) && !fons__tt_canRenderSDF())
+        USAGI_THROW(std::runtime_error(
+            "FONS_SDF is not supported by the font backend"));
+
+    if(params.renderAddPage != NULL && params.renderUpdateRects == NULL)
+        USAGI_THROW(std::runtime_error(
+            "renderAddPage requires renderUpdateRects"));
+
+    params.height = fons__clampAtlasHeight(params.width, params.height);
+
     if(params.renderCreate != NULL)
     {
         if(params.renderCreate(params.userPtr, params.width, params.height) == 0
@@ -410,24 +991,26 @@ void FONScontext::init(FONSparams params_)
             USAGI_THROW(std::runtime_error("failed to create texture"));
     }
 
-    fons__allocAtlas(params.width, params.height);
+    fons__buildPages(params.width, params.height);
 
     // Create texture for the cache.
     itw = 1.0f / params.width;
     ith = 1.0f / params.height;
-    texData.reset(new unsigned char[params.width * params.height]);
-    memset(texData.get(), 0, params.width * params.height);
+    texData.emplace_back(new unsigned char[params.width * params.height]);
+    memset(texData[0].get(), 0, params.width * params.height);
 
-    dirtyRect[0] = params.width;
-    dirtyRect[1] = params.height;
-    dirtyRect[2] = 0;
-    dirtyRect[3] = 0;
+    fons__resetDirty();
 
     // Add white rect at 0,0 for debug drawing.
     fons__addWhiteRect(2, 2);
 
     pushState();
     clearState();
+
+#ifndef FONS_USE_FREETYPE
+    if(params.threads > 0)
+        workers.fons__workersStart(params.threads);
+#endif
 }
 
 FONSstate * FONScontext::getState()
@@ -439,61 +1022,202 @@ int FONScontext::addFallbackFont(int base, int fallback)
 {
     FONSfont &baseFont = fonts[base];
     baseFont.fallbacks.push_back(fallback);
+    // Codepoints missing so far may be in the new fallback.
+    baseFont.resolved.clear();
     return 1;
 }
 
-void FONScontext::pushState()
+size_t FONScontext::fonsCmapIndexMemory() const
 {
-    states.push_back(states.empty() ? FONSstate { } : states.back());
+    size_t bytes = 0;
+    for(auto &&font : fonts)
+    {
+        bytes += font.cmapIndex.capacity() * sizeof(font.cmapIndex[0]);
+        for(auto &&block : font.cmapIndex)
+        {
+            if(block)
+                bytes += 256 * sizeof(unsigned short);
+        }
+    }
+    return bytes;
 }
 
-void FONScontext::popState()
+int FONScontext::fonsPrewarm(
+    int font,
+    const std::vector<float> &sizes,
+    const std::vector<float> &blurs,
+    std::u32string_view chars)
 {
-    if(states.size() <= 1)
+    std::unordered_set<unsigned long long> keys;
+    int added;
+
+    if(font < 0 || font >= (int)fonts.size())
+        USAGI_THROW(std::runtime_error("invalid font index"));
+    if(!fons__loadFont(&fonts[font]))
+        USAGI_THROW(std::runtime_error("invalid font data"));
+
+    glyphJobs.clear();
+    for(auto &&size : sizes)
     {
-        USAGI_THROW(std::runtime_error("state stack underflow"));
+        const short isize = (short)(size * 10.0f);
+        if(isize < 2) continue;
+        for(auto &&blur : blurs)
+        {
+            for(auto &&codepoint : chars)
+            {
+                glyphJobs.emplace_back();
+                FONSglyphJob &job = glyphJobs.back();
+                // Sizes, blurs and codepoints may map to the same glyph,
+                // e.g. with distance fields or missing characters.
+                if(fons__prepareGlyph(&fonts[font], codepoint, isize,
+                    (short)blur, &job) != NULL ||
+                    !keys.insert((unsigned long long)job.renderFont << 48 |
+                        (unsigned long long)job.index << 32 |
+                        (unsigned)(unsigned short)job.isize << 16 |
+                        (unsigned short)job.iblur).second)
+                {
+                    glyphJobs.pop_back();
+                }
+            }
+        }
     }
-    states.pop_back();
+
+    // The skyline packs best when the rows are filled by height.
+    std::sort(glyphJobs.begin(), glyphJobs.end(),
+        [](const FONSglyphJob &a, const FONSglyphJob &b) {
+            const int ha = a.y1 - a.y0 + a.pad * 2;
+            const int hb = b.y1 - b.y0 + b.pad * 2;
+            if(ha != hb) return ha > hb;
+            return a.x1 - a.x0 + a.pad * 2 > b.x1 - b.x0 + b.pad * 2;
+        });
+
+    added = (int)glyphJobs.size();
+    fons__loadGlyphs();
+
+    return added;
 }
 
-void FONScontext::clearState()
+int FONScontext::fonsPrewarm(
+    int font,
+    const std::vector<float> &sizes,
+    const std::vector<float> &blurs,
+    const std::vector<std::pair<char32_t, char32_t>> &ranges)
 {
-    FONSstate *state = getState();
+    std::u32string chars;
+
+    for(auto &&r : ranges)
+    {
+        // Codepoints end at U+10FFFF. The counter is wider than char32_t
+        // so that it cannot wrap.
+        const unsigned long long last =
+            std::min<char32_t>(r.second, 0x10ffff);
+        for(unsigned long long c = r.first; c <= last; c++)
+            chars.push_back((char32_t)c);
+    }
+    return fonsPrewarm(font, sizes, blurs, chars);
+}
+
+void FONScontext::pushState()
+{
+    states.push_back(states.empty() ? FONSstate { } : states.back());
+}
+
+void FONScontext::popState()
+{
+    if(states.size() <= 1)
+    {
+        USAGI_THROW(std::runtime_error("state stack underflow"));
+    }
+    states.pop_back();
+}
+
+void FONScontext::clearState()
+{
+    FONSstate *state = getState();
     *state = FONSstate();
 }
 
-int FONScontext::fonsAddFont(
-    std::string name,
+std::shared_ptr<const FONSfontData> FONScontext::fonsMapFontData(
     const std::filesystem::path &path)
 {
-    const auto data = usagi::readFileAsString(path);
-    return fonsAddFontMem(std::move(name), std::move(data));
+    static std::mutex mutex;
+    static std::unordered_map<std::string,
+        std::weak_ptr<const FONSfontData>> mapped;
+    std::error_code ec;
+    std::string key;
+
+    auto canonical = std::filesystem::canonical(path, ec);
+    key = (ec ? path : canonical).generic_string();
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto shared = mapped[key].lock();
+    if(shared)
+        return shared;
+
+    auto data = std::make_shared<FONSfontData>();
+    if(!data->file.fons__mapFile(path))
+    {
+        mapped.erase(key);
+        return nullptr;
+    }
+    data->data = data->file.data;
+    data->size = data->file.size;
+
+    // Forget the fonts nobody uses anymore.
+    for(auto i = mapped.begin(); i != mapped.end();)
+    {
+        if(i->second.expired())
+            i = mapped.erase(i);
+        else
+            ++i;
+    }
+    mapped[key] = data;
+    return data;
 }
 
-int FONScontext::fonsAddFontMem(
+int FONScontext::fonsAddFont(
     std::string name,
-    std::string data)
+    const std::filesystem::path &path)
 {
-    int i, ascent, descent, fh, lineGap;
     FONSfont *font;
 
-    fonts.emplace_back();
-    auto idx = fonts.size() - 1;
-    font = &fonts.back();
+    fons__waitGlyphs();
 
+    // The file is mapped and parsed when the font is first used.
+    font = &fonts.emplace_back();
     font->name = std::move(name);
+    font->path = path;
 
-    // Init hash lookup.
-    for(i = 0; i < FONS_HASH_LUT_SIZE; ++i)
-        font->lut[i] = -1;
+    return (int)(fonts.size() - 1);
+}
 
-    // Read in the font data.
-    font->data = std::move(data);
+int FONScontext::fons__loadFont(FONSfont *font)
+{
+    if(font->data)
+        return 1;
+    if(font->loadFailed)
+        return 0;
 
-    // Init font
-    if(!fons__tt_loadFont(this, &font->font, (unsigned char*)font->data.data(),
-        (int)font->data.size()))
-        USAGI_THROW(std::runtime_error("failed to load font"));
+    auto data = fonsMapFontData(font->path);
+    if(!data || !fons__initFont(font, std::move(data)))
+    {
+        font->loadFailed = 1;
+        return 0;
+    }
+    return 1;
+}
+
+int FONScontext::fons__initFont(
+    FONSfont *font,
+    std::shared_ptr<const FONSfontData> data)
+{
+    int ascent, descent, fh, lineGap;
+
+    // Fonts only read the data, it is shared with the other contexts.
+    if(!fons__tt_loadFont(this, &font->font, (unsigned char*)data->data,
+        (int)data->size))
+        return 0;
+    font->data = std::move(data);
 
     // Store normalized line height. The real line height is got
     // by multiplying the lineh by font size.
@@ -502,6 +1226,41 @@ int FONScontext::fonsAddFontMem(
     font->ascender = (float)ascent / (float)fh;
     font->descender = (float)descent / (float)fh;
     font->lineh = (float)(fh + lineGap) / (float)fh;
+    font->hasKerning = fons__tt_hasKerning(&font->font);
+
+    return 1;
+}
+
+int FONScontext::fonsAddFontMem(
+    std::string name,
+    std::string data)
+{
+    auto shared = std::make_shared<FONSfontData>();
+    shared->memory = std::move(data);
+    shared->data = (const unsigned char *)shared->memory.data();
+    shared->size = shared->memory.size();
+    return fonsAddFontData(std::move(name), std::move(shared));
+}
+
+int FONScontext::fonsAddFontData(
+    std::string name,
+    std::shared_ptr<const FONSfontData> data)
+{
+    FONSfont *font;
+
+    // Queued glyphs refer to the fonts by index, but the workers must not
+    // be reading them while they move.
+    fons__waitGlyphs();
+
+    fonts.emplace_back();
+    auto idx = fonts.size() - 1;
+    font = &fonts.back();
+
+    font->name = std::move(name);
+
+    // Init font
+    if(!fons__initFont(font, std::move(data)))
+        USAGI_THROW(std::runtime_error("failed to load font"));
 
     return (int)idx;
 }
@@ -522,6 +1281,227 @@ FONSglyph * FONSfont::fons__allocGlyph()
     return &glyphs.emplace_back();
 }
 
+int FONSfont::fons__getKern(int glyph1, int glyph2)
+{
+    // Fonts without kerning, such as most CJK fallbacks, get no tables.
+    if(!hasKerning)
+        return 0;
+    if(glyph1 < FONS_KERN_DENSE_SIZE && glyph2 < FONS_KERN_DENSE_SIZE)
+    {
+        if(!kernDense)
+        {
+            const int n = FONS_KERN_DENSE_SIZE * FONS_KERN_DENSE_SIZE;
+            kernDense.reset(new short[n]);
+            for(int i = 0; i < n; ++i)
+                kernDense[i] = FONS_KERN_UNKNOWN;
+        }
+        short &k = kernDense[glyph1 * FONS_KERN_DENSE_SIZE + glyph2];
+        if(k == FONS_KERN_UNKNOWN)
+            k = (short)fons__tt_getGlyphKernAdvance(&font, glyph1, glyph2);
+        return k;
+    }
+
+    const unsigned int key = (unsigned int)glyph1 << 16 |
+        (unsigned int)(glyph2 & 0xffff);
+    const auto iter = kernSparse.find(key);
+    if(iter != kernSparse.end())
+        return iter->second;
+    const int k = fons__tt_getGlyphKernAdvance(&font, glyph1, glyph2);
+    kernSparse.emplace(key, k);
+    return k;
+}
+
+int FONSfont::fons__findKern(int glyph1, int glyph2, int *kern) const
+{
+    if(!hasKerning)
+    {
+        *kern = 0;
+        return 1;
+    }
+    if(glyph1 < FONS_KERN_DENSE_SIZE && glyph2 < FONS_KERN_DENSE_SIZE)
+    {
+        if(!kernDense)
+            return 0;
+        const short k = kernDense[glyph1 * FONS_KERN_DENSE_SIZE + glyph2];
+        if(k == FONS_KERN_UNKNOWN)
+            return 0;
+        *kern = k;
+        return 1;
+    }
+
+    const unsigned int key = (unsigned int)glyph1 << 16 |
+        (unsigned int)(glyph2 & 0xffff);
+    const auto iter = kernSparse.find(key);
+    if(iter == kernSparse.end())
+        return 0;
+    *kern = iter->second;
+    return 1;
+}
+
+int FONSfont::fons__glyphIndex(unsigned int codepoint)
+{
+    if(codepoint >= FONS_CMAP_INDEX_SIZE)
+        return fons__tt_getGlyphIndex(&font, codepoint);
+
+    if(cmapIndex.empty())
+        cmapIndex.resize(FONS_CMAP_INDEX_SIZE / 256);
+    auto &block = cmapIndex[codepoint >> 8];
+    if(!block)
+    {
+        block.reset(new unsigned short[256]);
+        fons__tt_getGlyphIndices(&font, codepoint & ~0xffu, 256,
+            block.get());
+    }
+    return block[codepoint & 0xff];
+}
+
+int FONSglyphTable::fons__tableFind(
+    unsigned int index,
+    short size,
+    short blur) const
+{
+    if(count == 0) return -1;
+
+    const unsigned int mask = (unsigned int)keys.size() - 1;
+    unsigned int h = fons__hashglyph(index, size, blur) & mask;
+    // Linear probing. The table is never full so an empty slot always ends
+    // the search.
+    while(values[h] != -1)
+    {
+        const FONSglyphKey &k = keys[h];
+        if(k.index == index && k.size == size && k.blur == blur)
+            return values[h];
+        h = (h + 1) & mask;
+    }
+    return -1;
+}
+
+void FONSglyphTable::fons__tableInsert(FONSglyphKey key, int value)
+{
+    if((count + 1) * 4 > (int)keys.size() * 3)
+        fons__tableGrow(keys.empty() ?
+            FONS_GLYPH_TABLE_INIT_SIZE : (int)keys.size() * 2);
+
+    const unsigned int mask = (unsigned int)keys.size() - 1;
+    unsigned int h = fons__hashglyph(key.index, key.size, key.blur) & mask;
+    while(values[h] != -1)
+        h = (h + 1) & mask;
+    keys[h] = key;
+    values[h] = value;
+    ++count;
+}
+
+void FONSglyphTable::fons__tableGrow(int capacity)
+{
+    std::vector<FONSglyphKey> oldKeys = std::move(keys);
+    std::vector<int> oldValues = std::move(values);
+
+    keys.assign(capacity, FONSglyphKey { });
+    values.assign(capacity, -1);
+    count = 0;
+
+    for(int i = 0; i < (int)oldValues.size(); ++i)
+    {
+        if(oldValues[i] != -1)
+            fons__tableInsert(oldKeys[i], oldValues[i]);
+    }
+}
+
+void FONSglyphTable::fons__tableClear()
+{
+    keys.clear();
+    values.clear();
+    count = 0;
+}
+
+void FONSworkers::fons__workersStart(int n)
+{
+    while((int)threads.size() < n)
+    {
+        threads.emplace_back([this]() {
+            std::unique_lock<std::mutex> lock(mutex);
+            for(;;)
+            {
+                wake.wait(lock, [this]() { return quit || !tasks.empty(); });
+                // Finish the queue before quitting.
+                if(tasks.empty()) return;
+                std::function<void()> task = std::move(tasks.front());
+                tasks.pop_front();
+                lock.unlock();
+                task();
+                lock.lock();
+            }
+        });
+    }
+}
+
+void FONSworkers::fons__workersStop()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        quit = true;
+    }
+    wake.notify_all();
+    for(auto &&t : threads)
+        t.join();
+    threads.clear();
+    quit = false;
+}
+
+void FONSworkers::fons__workersSubmit(std::function<void()> task)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        tasks.push_back(std::move(task));
+    }
+    wake.notify_one();
+}
+
+void FONSworkers::fons__workersFor(int n, const std::function<void(int)> &fn)
+{
+    struct Batch
+    {
+        std::atomic<int> next { 0 };
+        std::atomic<int> done { 0 };
+        int n;
+        const std::function<void(int)> *fn;
+        std::mutex mutex;
+        std::condition_variable finished;
+    };
+    int i;
+
+    if(n <= 0) return;
+
+    // Helpers that only get to run after the batch is done find nothing
+    // left to do and never touch fn.
+    auto batch = std::make_shared<Batch>();
+    batch->n = n;
+    batch->fn = &fn;
+    auto run = [batch]() {
+        int i;
+        while((i = batch->next.fetch_add(1)) < batch->n)
+        {
+            (*batch->fn)(i);
+            if(batch->done.fetch_add(1) + 1 == batch->n)
+            {
+                std::lock_guard<std::mutex> lock(batch->mutex);
+                batch->finished.notify_all();
+            }
+        }
+    };
+    for(i = 0; i < (int)threads.size() && i < n - 1; i++)
+        fons__workersSubmit(run);
+    run();
+
+    std::unique_lock<std::mutex> lock(batch->mutex);
+    batch->finished.wait(lock, [&]() { return batch->done == n; });
+}
+
+FONSworkers::~FONSworkers()
+{
+    fons__workersStop();
+}
+
 // Based on Exponential blur, Jani Huhtanen, 2006
 
 #define APREC 16
@@ -550,200 +1530,830 @@ void fons__blurCols(unsigned char *dst, int w, int h, int dstStride, int alpha)
     }
 }
 
-void fons__blurRows(unsigned char *dst, int w, int h, int dstStride, int alpha)
-{
-    int x, y;
-    for(x = 0; x < w; x++)
+#if defined(FONS_SIMD_SSE2) || defined(FONS_SIMD_NEON)
+#	define FONS_SIMD_BLUR
+#endif
+
+#ifdef FONS_SIMD_BLUR
+
+// The lanes below hold z in 16 bits, which needs these exact precisions.
+static_assert(APREC == 16 && ZPREC == 7, "blur precision");
+
+// One step of the recursion in 16 bit lanes. alpha does not fit a signed
+// 16 bit lane, so it is passed as alpha - 65536 when above 32767 and the
+// product is corrected by adding d (fix is all ones then). The high half
+// of the product is the floor of the shift, as in the scalar code.
+#ifdef FONS_SIMD_SSE2
+inline __m128i fons__blurStep(__m128i z, __m128i v, __m128i a, __m128i fix)
+{
+    const __m128i d = _mm_sub_epi16(_mm_slli_epi16(v, ZPREC), z);
+    const __m128i p = _mm_add_epi16(_mm_mulhi_epi16(d, a),
+        _mm_and_si128(d, fix));
+    return _mm_add_epi16(z, p);
+}
+
+// Blurs 16 adjacent columns as two independent chains of 8.
+void fons__blurRows16(unsigned char *dst, int h, int dstStride, int alpha)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i a = _mm_set1_epi16((short)alpha);
+    const __m128i fix = _mm_set1_epi16(alpha > 0x7fff ? -1 : 0);
+    __m128i z0, z1, v;
+    unsigned char *p;
+    int y;
+
+    z0 = z1 = zero; // force zero border
+    for(y = 1; y < h; y++)
+    {
+        p = dst + y * dstStride;
+        v = _mm_loadu_si128((const __m128i*)p);
+        z0 = fons__blurStep(z0, _mm_unpacklo_epi8(v, zero), a, fix);
+        z1 = fons__blurStep(z1, _mm_unpackhi_epi8(v, zero), a, fix);
+        _mm_storeu_si128((__m128i*)p, _mm_packus_epi16(
+            _mm_srli_epi16(z0, ZPREC), _mm_srli_epi16(z1, ZPREC)));
+    }
+    _mm_storeu_si128((__m128i*)(dst + (h - 1) * dstStride), zero);
+    z0 = z1 = zero;
+    for(y = h - 2; y >= 0; y--)
+    {
+        p = dst + y * dstStride;
+        v = _mm_loadu_si128((const __m128i*)p);
+        z0 = fons__blurStep(z0, _mm_unpacklo_epi8(v, zero), a, fix);
+        z1 = fons__blurStep(z1, _mm_unpackhi_epi8(v, zero), a, fix);
+        _mm_storeu_si128((__m128i*)p, _mm_packus_epi16(
+            _mm_srli_epi16(z0, ZPREC), _mm_srli_epi16(z1, ZPREC)));
+    }
+    _mm_storeu_si128((__m128i*)dst, zero);
+}
+#endif
+
+#ifdef FONS_SIMD_AVX2
+inline __m256i fons__blurStep(__m256i z, __m256i v, __m256i a, __m256i fix)
+{
+    const __m256i d = _mm256_sub_epi16(_mm256_slli_epi16(v, ZPREC), z);
+    const __m256i p = _mm256_add_epi16(_mm256_mulhi_epi16(d, a),
+        _mm256_and_si256(d, fix));
+    return _mm256_add_epi16(z, p);
+}
+
+// Blurs 32 adjacent columns as two independent chains of 16.
+void fons__blurRows32(unsigned char *dst, int h, int dstStride, int alpha)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i a = _mm256_set1_epi16((short)alpha);
+    const __m256i fix = _mm256_set1_epi16(alpha > 0x7fff ? -1 : 0);
+    __m256i z0, z1, v;
+    unsigned char *p;
+    int y;
+
+    // packus works within 128 bit halves, the permute restores the order.
+#	define FONS_BLUR_ROW32() \
+        p = dst + y * dstStride; \
+        z0 = fons__blurStep(z0, _mm256_cvtepu8_epi16( \
+            _mm_loadu_si128((const __m128i*)p)), a, fix); \
+        z1 = fons__blurStep(z1, _mm256_cvtepu8_epi16( \
+            _mm_loadu_si128((const __m128i*)(p + 16))), a, fix); \
+        _mm256_storeu_si256((__m256i*)p, _mm256_permute4x64_epi64( \
+            _mm256_packus_epi16(_mm256_srli_epi16(z0, ZPREC), \
+                _mm256_srli_epi16(z1, ZPREC)), 0xd8))
+
+    z0 = z1 = zero; // force zero border
+    for(y = 1; y < h; y++)
+    {
+        FONS_BLUR_ROW32();
+    }
+    _mm256_storeu_si256((__m256i*)(dst + (h - 1) * dstStride), zero);
+    z0 = z1 = zero;
+    for(y = h - 2; y >= 0; y--)
+    {
+        FONS_BLUR_ROW32();
+    }
+    _mm256_storeu_si256((__m256i*)dst, zero);
+
+#	undef FONS_BLUR_ROW32
+}
+#endif
+
+#ifdef FONS_SIMD_NEON
+inline int16x8_t fons__blurStep(
+    int16x8_t z,
+    int16x8_t v,
+    int16x4_t a,
+    int16x8_t fix)
+{
+    const int16x8_t d = vsubq_s16(vshlq_n_s16(v, ZPREC), z);
+    const int16x8_t p = vcombine_s16(
+        vshrn_n_s32(vmull_s16(vget_low_s16(d), a), 16),
+        vshrn_n_s32(vmull_s16(vget_high_s16(d), a), 16));
+    return vaddq_s16(z, vaddq_s16(p, vandq_s16(d, fix)));
+}
+
+// Blurs 16 adjacent columns as two independent chains of 8.
+void fons__blurRows16(unsigned char *dst, int h, int dstStride, int alpha)
+{
+    const int16x4_t a = vdup_n_s16((short)alpha);
+    const int16x8_t fix = vdupq_n_s16(alpha > 0x7fff ? -1 : 0);
+    int16x8_t z0, z1;
+    uint8x16_t v;
+    unsigned char *p;
+    int y;
+
+    z0 = z1 = vdupq_n_s16(0); // force zero border
+    for(y = 1; y < h; y++)
+    {
+        p = dst + y * dstStride;
+        v = vld1q_u8(p);
+        z0 = fons__blurStep(z0,
+            vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(v))), a, fix);
+        z1 = fons__blurStep(z1,
+            vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(v))), a, fix);
+        vst1q_u8(p, vcombine_u8(vqmovun_s16(vshrq_n_s16(z0, ZPREC)),
+            vqmovun_s16(vshrq_n_s16(z1, ZPREC))));
+    }
+    vst1q_u8(dst + (h - 1) * dstStride, vdupq_n_u8(0));
+    z0 = z1 = vdupq_n_s16(0);
+    for(y = h - 2; y >= 0; y--)
+    {
+        p = dst + y * dstStride;
+        v = vld1q_u8(p);
+        z0 = fons__blurStep(z0,
+            vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(v))), a, fix);
+        z1 = fons__blurStep(z1,
+            vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(v))), a, fix);
+        vst1q_u8(p, vcombine_u8(vqmovun_s16(vshrq_n_s16(z0, ZPREC)),
+            vqmovun_s16(vshrq_n_s16(z1, ZPREC))));
+    }
+    vst1q_u8(dst, vdupq_n_u8(0));
+}
+#endif
+
+void fons__transpose(
+    const unsigned char *src,
+    int w,
+    int h,
+    int srcStride,
+    unsigned char *dst,
+    int dstStride)
+{
+    int x, y;
+    for(y = 0; y < h; y++)
+    {
+        for(x = 0; x < w; x++)
+            dst[x * dstStride + y] = src[y * srcStride + x];
+    }
+}
+
+#endif
+
+void fons__blurRows(unsigned char *dst, int w, int h, int dstStride, int alpha)
+{
+    int x = 0, y;
+
+    // Columns are independent, blur as many as possible in parallel lanes.
+#ifdef FONS_SIMD_AVX2
+    for(; x + 32 <= w; x += 32)
+        fons__blurRows32(dst + x, h, dstStride, alpha);
+#endif
+#ifdef FONS_SIMD_BLUR
+    for(; x + 16 <= w; x += 16)
+        fons__blurRows16(dst + x, h, dstStride, alpha);
+#endif
+    dst += x;
+
+    for(; x < w; x++)
+    {
+        int z = 0; // force zero border
+        for(y = dstStride; y < h * dstStride; y += dstStride)
+        {
+            z += (alpha * (((int)(dst[y]) << ZPREC) - z)) >> APREC;
+            dst[y] = (unsigned char)(z >> ZPREC);
+        }
+        dst[(h - 1) * dstStride] = 0; // force zero border
+        z = 0;
+        for(y = (h - 2) * dstStride; y >= 0; y -= dstStride)
+        {
+            z += (alpha * (((int)(dst[y]) << ZPREC) - z)) >> APREC;
+            dst[y] = (unsigned char)(z >> ZPREC);
+        }
+        dst[0] = 0; // force zero border
+        dst++;
+    }
+}
+
+
+static void fons__blurBitmap(
+    unsigned char *dst,
+    int w,
+    int h,
+    int dstStride,
+    int blur,
+    std::vector<unsigned char> &scratch)
+{
+    int alpha;
+    float sigma;
+
+    if(blur < 1)
+        return;
+    // Calculate the alpha such that 90% of the kernel is within the radius. (Kernel extends to infinity)
+    sigma = (float)blur * 0.57735f; // 1 / sqrt(3)
+    alpha = (int)((1 << APREC) * (1.0f - expf(-2.3f / (sigma + 1.0f))));
+#ifdef FONS_SIMD_BLUR
+    // Blur the glyph and a transposed copy of it down their columns, so
+    // that both directions run across the vector lanes. The copies are
+    // padded to whole vectors, the extra columns are blurred along but
+    // never read back.
+    const int pw = (w + 15) & ~15;
+    const int ph = (h + 15) & ~15;
+    unsigned char *a, *t;
+    int y;
+    scratch.resize(pw * h + ph * w);
+    a = scratch.data();
+    t = a + pw * h;
+    for(y = 0; y < h; y++)
+        memcpy(&a[y * pw], &dst[y * dstStride], w);
+    fons__blurRows(a, pw, h, pw, alpha);
+    fons__transpose(a, w, h, pw, t, ph);
+    fons__blurRows(t, ph, w, ph, alpha);
+    fons__transpose(t, h, w, ph, a, pw);
+    fons__blurRows(a, pw, h, pw, alpha);
+    fons__transpose(a, w, h, pw, t, ph);
+    fons__blurRows(t, ph, w, ph, alpha);
+    fons__transpose(t, h, w, ph, dst, dstStride);
+#else
+    FONS_NOTUSED(scratch);
+    fons__blurRows(dst, w, h, dstStride, alpha);
+    fons__blurCols(dst, w, h, dstStride, alpha);
+    fons__blurRows(dst, w, h, dstStride, alpha);
+    fons__blurCols(dst, w, h, dstStride, alpha);
+#endif
+    //	fons__blurrows(dst, w, h, dstStride, alpha);
+    //	fons__blurcols(dst, w, h, dstStride, alpha);
+}
+
+void FONScontext::fons__blur(
+    unsigned char *dst,
+    int w,
+    int h,
+    int dstStride,
+    int blur)
+{
+    fons__blurBitmap(dst, w, h, dstStride, blur, blurScratch);
+}
+
+void FONScontext::fons__resolveGlyph(
+    FONSfont *font,
+    unsigned int codepoint,
+    FONSfont **renderFont,
+    int *glyph)
+{
+    unsigned int block = codepoint >> 8, entry;
+    int i, g;
+
+    // Beyond Unicode, keeps the table from growing without bound.
+    if(codepoint > 0x10ffff)
+    {
+        *renderFont = font;
+        *glyph = 0;
+        return;
+    }
+    if(block >= font->resolved.size())
+        font->resolved.resize(block + 1);
+    auto &table = font->resolved[block];
+    if(!table)
+    {
+        table.reset(new unsigned int[256]);
+        std::fill(table.get(), table.get() + 256, FONS_UNRESOLVED);
+    }
+    entry = table[codepoint & 0xff];
+    if(entry == FONS_UNRESOLVED)
+    {
+        entry = (unsigned int)(font - fonts.data()) << 16;
+        // Glyph indices of TrueType fonts are 16 bit, larger ones are
+        // treated as missing.
+        g = font->fons__glyphIndex(codepoint);
+        if(g > 0 && g <= 0xffff)
+        {
+            entry |= g;
+        }
+        else
+        {
+            // Try to find the glyph in fallback fonts. Those are only
+            // loaded once a codepoint asks for them.
+            for(i = 0; i < font->fallbacks.size(); ++i)
+            {
+                FONSfont *fallbackFont = &fonts[font->fallbacks[i]];
+                if(!fons__loadFont(fallbackFont)) continue;
+                g = fallbackFont->fons__glyphIndex(codepoint);
+                if(g > 0 && g <= 0xffff)
+                {
+                    entry = (unsigned int)font->fallbacks[i] << 16 | g;
+                    break;
+                }
+            }
+        }
+        table[codepoint & 0xff] = entry;
+    }
+    *renderFont = &fonts[entry >> 16];
+    *glyph = entry & 0xffff;
+}
+
+int FONScontext::fons__glyphVariant(short *isize, short *iblur, float *size)
+{
+    if(params.flags & FONS_SDF)
+    {
+        // One field per glyph serves every size.
+        *isize = FONS_SDF_SIZE * 10;
+        *iblur = 0;
+        *size = FONS_SDF_SIZE;
+        // The field brings its own padding, plus the empty border.
+        return FONS_SDF_PADDING + 1;
+    }
+    // Both channels are padded for the larger blur.
+    if(fons__glyphChannels(*iblur) > 1)
+        return fons__maxi(fons__textBlur(*iblur),
+            fons__shadowBlur(*iblur)) + 2;
+    if(*iblur > 20) *iblur = 20;
+    return *iblur + 2;
+}
+
+FONSglyph * FONScontext::fons__prepareGlyph(
+    FONSfont *font,
+    unsigned int codepoint,
+    short isize,
+    short iblur,
+    FONSglyphJob *job)
+{
+    int i, g, advance, lsb, x0, y0, x1, y1, gw, gh, y, stride;
+    float scale;
+    float size = isize / 10.0f;
+    int pad, sharp;
+    short xadv;
+    unsigned char *data;
+    FONSfont *renderFont = font;
+
+    pad = fons__glyphVariant(&isize, &iblur, &size);
+
+    // Find the font that has the code point, then the glyph and size. It
+    // is possible that no font of the chain has it, then the glyph index
+    // 'g' is 0 and we'll proceed below and cache empty glyph.
+    fons__resolveGlyph(font, codepoint, &renderFont, &g);
+    i = renderFont->lut.fons__tableFind(g, isize, iblur);
+    if(i != -1)
+        return &renderFont->glyphs[i];
+
+    // Blurred variants start from the sharp bitmap if it is cached. It is
+    // copied out first, making room for the new glyph may evict it.
+    sharp = iblur > 0 ? renderFont->lut.fons__tableFind(g, isize, 0) : -1;
+    if(sharp != -1 && renderFont->glyphs[sharp].page < 0)
+        sharp = -1;
+    if(sharp != -1)
+    {
+        const FONSglyph &s = renderFont->glyphs[sharp];
+        // Sharp glyphs have a padding of 2.
+        xadv = s.xadv;
+        x0 = s.xoff + 2;
+        y0 = s.yoff + 2;
+        x1 = x0 + s.x1 - s.x0 - 4;
+        y1 = y0 + s.y1 - s.y0 - 4;
+        gw = x1 - x0 + pad * 2;
+        gh = y1 - y0 + pad * 2;
+        stride = gw * fons__glyphChannels(iblur);
+        job->bitmap.assign(stride * gh, 0);
+        data = texData[pages[s.page].layer].get();
+        for(y = 0; y < y1 - y0; y++)
+        {
+            memcpy(&job->bitmap[pad + (pad + y) * stride],
+                &data[(s.x0 + 2) + (s.y0 + 2 + y) * params.width], x1 - x0);
+        }
+    }
+    scale = fons__tt_getPixelHeightScale(&renderFont->font, size);
+    if(sharp == -1)
+    {
+        fons__tt_buildGlyphBitmap(&renderFont->font, g, size, scale,
+            &advance, &lsb, &x0, &y0, &x1, &y1);
+        xadv = (short)(scale * advance * 10.0f);
+        // The zeroed bitmap leaves the one pixel empty border.
+        job->bitmap.assign((x1 - x0 + pad * 2) * fons__glyphChannels(iblur) *
+            (y1 - y0 + pad * 2), 0);
+    }
+
+    job->renderFont = (int)(renderFont - fonts.data());
+    job->isize = isize;
+    job->iblur = iblur;
+    job->index = g;
+    job->scale = scale;
+    job->xadv = xadv;
+    job->x0 = x0;
+    job->y0 = y0;
+    job->x1 = x1;
+    job->y1 = y1;
+    job->pad = pad;
+    job->copied = sharp != -1;
+
+    return NULL;
+}
+
+void FONScontext::fons__rasterizeGlyph(
+    FONSglyphJob *job,
+    std::vector<unsigned char> &scratch)
+{
+    const int pad = job->pad;
+    const int gw = job->x1 - job->x0 + pad * 2;
+    const int gh = job->y1 - job->y0 + pad * 2;
+    const int stride = gw * fons__glyphChannels(job->iblur);
+    FONSfont *renderFont = &fonts[job->renderFont];
+    unsigned char *dst;
+    int y;
+
+    // Rasterize
+    if(job->copied)
+    {
+        // empty
+    }
+    else if(params.flags & FONS_SDF)
+    {
+        dst = &job->bitmap[1 + gw];
+        fons__tt_renderGlyphSDF(&renderFont->font, dst, gw - 2, gh - 2,
+            gw, job->scale, job->index);
+    }
+    else
+    {
+        dst = &job->bitmap[pad + pad * stride];
+        fons__tt_renderGlyphBitmap(&renderFont->font, dst, gw - pad * 2,
+            gh - pad * 2, stride, job->scale, job->scale, job->index);
+    }
+
+    // The shadow channel is a copy blurred on its own.
+    if(stride > gw)
+    {
+        for(y = 0; y < gh; y++)
+            memcpy(&job->bitmap[gw + y * stride], &job->bitmap[y * stride], gw);
+        fons__blurBitmap(&job->bitmap[gw], gw, gh, stride,
+            fons__shadowBlur(job->iblur), scratch);
+    }
+
+    // Blur
+    if(fons__textBlur(job->iblur) > 0)
+        fons__blurBitmap(job->bitmap.data(), gw, gh, stride,
+            fons__textBlur(job->iblur), scratch);
+}
+
+FONSglyph * FONScontext::fons__storeGlyph(FONSglyphJob *job)
+{
+    const int gw = (job->x1 - job->x0 + job->pad * 2) *
+        fons__glyphChannels(job->iblur);
+    const int gh = job->y1 - job->y0 + job->pad * 2;
+    int i, gx, gy, page, added;
+    FONSglyph *glyph;
+    FONSfont *font = &fonts[job->renderFont];
+
+    // Queued and blocked glyphs have placeholders. A queued glyph may
+    // have been queued again after an atlas reset.
+    i = font->lut.fons__tableFind(job->index, job->isize, job->iblur);
+    if(i != -1 && font->glyphs[i].page >= 0)
+        return &font->glyphs[i];
+
+    // Find free spot for the rect in the atlas. When every page is still
+    // in flight the glyph waits for the next frame. Glyphs larger than
+    // the atlas are never drawn, they only take up their space.
+    added = fons__rectFitsPage(gw, gh) ?
+        fons__allocRect(gw, gh, &gx, &gy, &page) : -1;
+    if(added < 0)
+    {
+        if(handleError != NULL)
+            handleError(errorUptr, FONS_ATLAS_FULL, 0);
+        return i != -1 ? &font->glyphs[i] : fons__addPlaceholder(job);
+    }
+    if(added == 0)
+    {
+        glyph = i != -1 ? &font->glyphs[i] : fons__addPlaceholder(job);
+        blockedGlyphs.push_back(std::move(*job));
+        return glyph;
+    }
+
+    // Fill in the placeholder of a queued glyph, if it is still there.
+    // Making room may have moved it.
+    if(i != -1)
+    {
+        i = font->lut.fons__tableFind(job->index, job->isize, job->iblur);
+        glyph = &font->glyphs[i];
+        glyph->page = (short)page;
+        glyph->x0 = (short)gx;
+        glyph->y0 = (short)gy;
+        glyph->x1 = (short)(glyph->x0 + gw);
+        glyph->y1 = (short)(glyph->y0 + gh);
+        fons__copyGlyphBitmap(glyph, job);
+        return glyph;
+    }
+
+    // Init glyph.
+    glyph = font->fons__allocGlyph();
+    glyph->size = job->isize;
+    glyph->blur = job->iblur;
+    glyph->index = job->index;
+    glyph->page = (short)page;
+    glyph->x0 = (short)gx;
+    glyph->y0 = (short)gy;
+    glyph->x1 = (short)(glyph->x0 + gw);
+    glyph->y1 = (short)(glyph->y0 + gh);
+    glyph->xadv = job->xadv;
+    glyph->xoff = (short)(job->x0 - job->pad);
+    glyph->yoff = (short)(job->y0 - job->pad);
+
+    // Insert char to hash lookup.
+    font->lut.fons__tableInsert({ (unsigned)job->index, job->isize,
+        job->iblur },
+        (int)(font->glyphs.size() - 1));
+
+    fons__copyGlyphBitmap(glyph, job);
+    return glyph;
+}
+
+void FONScontext::fons__copyGlyphBitmap(FONSglyph *glyph, FONSglyphJob *job)
+{
+    const int gw = glyph->x1 - glyph->x0;
+    const int gh = glyph->y1 - glyph->y0;
+    const int layer = pages[glyph->page].layer;
+    unsigned char *dst;
+    int y;
+
+    // Copy the bitmap with its border into the atlas.
+    dst = &texData[layer][glyph->x0 + glyph->y0 * params.width];
+    for(y = 0; y < gh; y++)
+        memcpy(&dst[y * params.width], &job->bitmap[y * gw], gw);
+
+    fons__markDirty(layer, glyph->x0, glyph->y0, glyph->x1, glyph->y1);
+    fons__touchPage(glyph->page);
+}
+
+FONSglyph * FONScontext::fons__addPlaceholder(FONSglyphJob *job)
+{
+    FONSfont *font = &fonts[job->renderFont];
+    FONSglyph *glyph;
+
+    // The placeholder has the size of the glyph so that measuring and
+    // layout do not change when it arrives, but no page to be drawn from.
+    glyph = font->fons__allocGlyph();
+    glyph->size = job->isize;
+    glyph->blur = job->iblur;
+    glyph->index = job->index;
+    glyph->page = -1;
+    glyph->x0 = 0;
+    glyph->y0 = 0;
+    glyph->x1 = (short)((job->x1 - job->x0 + job->pad * 2) *
+        fons__glyphChannels(job->iblur));
+    glyph->y1 = (short)(job->y1 - job->y0 + job->pad * 2);
+    glyph->xadv = job->xadv;
+    glyph->xoff = (short)(job->x0 - job->pad);
+    glyph->yoff = (short)(job->y0 - job->pad);
+    font->lut.fons__tableInsert({ (unsigned)job->index, job->isize,
+        job->iblur },
+        (int)(font->glyphs.size() - 1));
+
+    return glyph;
+}
+
+FONSglyph * FONScontext::fons__queueGlyph(FONSglyphJob *job)
+{
+    FONSglyph *glyph = fons__addPlaceholder(job);
+
+    if(workers.threads.empty())
+    {
+        queuedGlyphs.push_back(std::move(*job));
+        return glyph;
+    }
+
+    auto task = std::make_shared<FONSglyphJob>(std::move(*job));
+    ++glyphsInFlight;
+    workers.fons__workersSubmit([this, task]() {
+        thread_local std::vector<unsigned char> scratch;
+        fons__rasterizeGlyph(task.get(), scratch);
+        std::lock_guard<std::mutex> lock(readyMutex);
+        readyGlyphs.push_back(std::move(*task));
+        glyphReady.notify_all();
+    });
+    return glyph;
+}
+
+void FONScontext::fons__waitGlyphs()
+{
+    std::unique_lock<std::mutex> lock(readyMutex);
+    glyphReady.wait(lock, [this]() {
+        return (int)readyGlyphs.size() == glyphsInFlight;
+    });
+}
+
+int FONScontext::fonsPumpGlyphs()
+{
+    using Clock = std::chrono::steady_clock;
+    const auto start = Clock::now();
+    const auto budget = std::chrono::duration<float, std::milli>(
+        params.rasterBudget);
+    int i, stored = 0;
+
+    {
+        std::lock_guard<std::mutex> lock(readyMutex);
+        glyphJobs.swap(readyGlyphs);
+        glyphsInFlight -= (int)glyphJobs.size();
+    }
+    for(i = 0; i < (int)glyphJobs.size(); i++)
+        fons__storeGlyph(&glyphJobs[i]);
+    stored += (int)glyphJobs.size();
+    glyphJobs.clear();
+
+    while(!queuedGlyphs.empty())
+    {
+        if(stored > 0 && Clock::now() - start >= budget)
+            break;
+        fons__rasterizeGlyph(&queuedGlyphs.front(), blurScratch);
+        fons__storeGlyph(&queuedGlyphs.front());
+        queuedGlyphs.pop_front();
+        ++stored;
+    }
+
+    // Layouts recorded while the glyphs were missing are stale.
+    if(stored > 0)
+        ++atlasGeneration;
+
+    return (int)(queuedGlyphs.size() + blockedGlyphs.size()) +
+        glyphsInFlight;
+}
+
+void FONScontext::fons__loadGlyphs()
+{
+    int i;
+
+    workers.fons__workersFor((int)glyphJobs.size(), [this](int j) {
+        thread_local std::vector<unsigned char> scratch;
+        fons__rasterizeGlyph(&glyphJobs[j], scratch);
+    });
+    for(i = 0; i < (int)glyphJobs.size(); i++)
+        fons__storeGlyph(&glyphJobs[i]);
+    glyphJobs.clear();
+}
+
+void FONScontext::fons__prefetchGlyphs(
+    FONSfont *font,
+    std::u32string_view str,
+    short isize,
+    short iblur)
+{
+    int i;
+
+    if(workers.threads.empty() || (params.flags & FONS_ASYNC) || isize < 2)
+        return;
+
+    glyphJobs.clear();
+    for(auto &&codepoint : str)
     {
-        int z = 0; // force zero border
-        for(y = dstStride; y < h * dstStride; y += dstStride)
+        glyphJobs.emplace_back();
+        FONSglyphJob &job = glyphJobs.back();
+        if(fons__prepareGlyph(font, codepoint, isize, iblur, &job) != NULL)
         {
-            z += (alpha * (((int)(dst[y]) << ZPREC) - z)) >> APREC;
-            dst[y] = (unsigned char)(z >> ZPREC);
+            glyphJobs.pop_back();
+            continue;
         }
-        dst[(h - 1) * dstStride] = 0; // force zero border
-        z = 0;
-        for(y = (h - 2) * dstStride; y >= 0; y -= dstStride)
+        // Repeated characters map to the same glyph.
+        for(i = 0; i < (int)glyphJobs.size() - 1; i++)
         {
-            z += (alpha * (((int)(dst[y]) << ZPREC) - z)) >> APREC;
-            dst[y] = (unsigned char)(z >> ZPREC);
+            if(glyphJobs[i].renderFont == job.renderFont &&
+                glyphJobs[i].index == job.index)
+                break;
         }
-        dst[0] = 0; // force zero border
-        dst++;
+        if(i < (int)glyphJobs.size() - 1)
+            glyphJobs.pop_back();
     }
+    fons__loadGlyphs();
 }
 
-
-void FONScontext::fons__blur(
-    unsigned char *dst,
-    int w,
-    int h,
-    int dstStride,
-    int blur)
+FONSglyph * FONScontext::getGlyph(
+    FONSfont *font,
+    unsigned int codepoint,
+    short isize,
+    short iblur)
 {
-    int alpha;
-    float sigma;
+    FONSglyph *glyph;
 
-    if(blur < 1)
-        return;
-    // Calculate the alpha such that 90% of the kernel is within the radius. (Kernel extends to infinity)
-    sigma = (float)blur * 0.57735f; // 1 / sqrt(3)
-    alpha = (int)((1 << APREC) * (1.0f - expf(-2.3f / (sigma + 1.0f))));
-    fons__blurRows(dst, w, h, dstStride, alpha);
-    fons__blurCols(dst, w, h, dstStride, alpha);
-    fons__blurRows(dst, w, h, dstStride, alpha);
-    fons__blurCols(dst, w, h, dstStride, alpha);
-    //	fons__blurrows(dst, w, h, dstStride, alpha);
-    //	fons__blurcols(dst, w, h, dstStride, alpha);
+    if(isize < 2 || !fons__loadFont(font)) return NULL;
+
+    glyph = fons__prepareGlyph(font, codepoint, isize, iblur, &glyphJob);
+    if(glyph != NULL)
+    {
+        if(glyph->page >= 0)
+            fons__touchPage(glyph->page);
+        return glyph;
+    }
+
+    if(params.flags & FONS_ASYNC)
+        return fons__queueGlyph(&glyphJob);
+
+    fons__rasterizeGlyph(&glyphJob, blurScratch);
+    return fons__storeGlyph(&glyphJob);
 }
 
-FONSglyph * FONScontext::getGlyph(
+FONSglyph * FONScontext::fons__measureGlyph(
     FONSfont *font,
     unsigned int codepoint,
     short isize,
     short iblur)
 {
-    int i, g, advance, lsb, x0, y0, x1, y1, gw, gh, gx, gy, x, y;
+    int i, g, pad, advance, lsb, x0, y0, x1, y1;
     float scale;
-    FONSglyph *glyph = NULL;
-    unsigned int h;
     float size = isize / 10.0f;
-    int pad, added;
-    unsigned char *bdst;
-    unsigned char *dst;
-    FONSfont *renderFont = font;
+    FONSglyph *glyph;
+    FONSfont *renderFont;
 
-    if(isize < 2) return NULL;
-    if(iblur > 20) iblur = 20;
-    pad = iblur + 2;
+    if(isize < 2 || !fons__loadFont(font)) return NULL;
 
-    // Find code point and size.
-    h = fons__hashint(codepoint) & (FONS_HASH_LUT_SIZE - 1);
-    i = font->lut[h];
-    while(i != -1)
-    {
-        if(font->glyphs[i].codepoint == codepoint && font->glyphs[i].size ==
-            isize && font->glyphs[i].blur == iblur)
-            return &font->glyphs[i];
-        i = font->glyphs[i].next;
-    }
+    pad = fons__glyphVariant(&isize, &iblur, &size);
+    fons__resolveGlyph(font, codepoint, &renderFont, &g);
+    // Glyphs in the atlas, or on their way there, have the same metrics.
+    i = renderFont->lut.fons__tableFind(g, isize, iblur);
+    if(i != -1)
+        return &renderFont->glyphs[i];
+    i = renderFont->metricsLut.fons__tableFind(g, isize, iblur);
+    if(i != -1)
+        return &renderFont->metrics[i];
 
-    // Could not find glyph, create it.
-    g = fons__tt_getGlyphIndex(&font->font, codepoint);
-    // Try to find the glyph in fallback fonts.
-    if(g == 0)
-    {
-        for(i = 0; i < font->fallbacks.size(); ++i)
-        {
-            FONSfont *fallbackFont = &fonts[font->fallbacks[i]];
-            int fallbackIndex = fons__tt_getGlyphIndex(&fallbackFont->font,
-                codepoint);
-            if(fallbackIndex != 0)
-            {
-                g = fallbackIndex;
-                renderFont = fallbackFont;
-                break;
-            }
-        }
-        // It is possible that we did not find a fallback glyph.
-        // In that case the glyph index 'g' is 0, and we'll proceed below and cache empty glyph.
-    }
     scale = fons__tt_getPixelHeightScale(&renderFont->font, size);
-    fons__tt_buildGlyphBitmap(&renderFont->font, g, size, scale, &advance, &lsb,
-        &x0, &y0, &x1, &y1);
-    gw = x1 - x0 + pad * 2;
-    gh = y1 - y0 + pad * 2;
+    fons__tt_buildGlyphBitmap(&renderFont->font, g, size, scale,
+        &advance, &lsb, &x0, &y0, &x1, &y1);
 
-    // Find free spot for the rect in the atlas
-    added = atlas.fons__atlasAddRect(gw, gh, &gx, &gy);
-    if(added == 0)
+    // Measuring many sizes would grow the cache without bound, start over
+    // once it is full.
+    if(renderFont->metrics.size() >= FONS_MAX_MEASURED_GLYPHS)
     {
-        // Atlas is full, let the user to resize the atlas (or not), and try again.
-        // handleError(errorUptr, FONS_ATLAS_FULL, 0);
-        fonsExpandAtlas(atlas.width, atlas.height * 2);
-        added = atlas.fons__atlasAddRect(gw, gh, &gx, &gy);
+        renderFont->metrics.clear();
+        renderFont->metricsLut.fons__tableClear();
     }
-    if(added == 0)
-        USAGI_THROW(std::runtime_error("unable to add glyph"));
 
-    // Init glyph.
-    glyph = font->fons__allocGlyph();
-    glyph->codepoint = codepoint;
+    // Same box as the glyph in the atlas, without a place in it.
+    renderFont->metrics.emplace_back();
+    glyph = &renderFont->metrics.back();
+    glyph->index = g;
     glyph->size = isize;
     glyph->blur = iblur;
-    glyph->index = g;
-    glyph->x0 = (short)gx;
-    glyph->y0 = (short)gy;
-    glyph->x1 = (short)(glyph->x0 + gw);
-    glyph->y1 = (short)(glyph->y0 + gh);
+    glyph->page = -1;
+    glyph->x0 = 0;
+    glyph->y0 = 0;
+    glyph->x1 = (short)((x1 - x0 + pad * 2) * fons__glyphChannels(iblur));
+    glyph->y1 = (short)(y1 - y0 + pad * 2);
     glyph->xadv = (short)(scale * advance * 10.0f);
     glyph->xoff = (short)(x0 - pad);
     glyph->yoff = (short)(y0 - pad);
-    glyph->next = 0;
-
-    // Insert char to hash lookup.
-    glyph->next = font->lut[h];
-    font->lut[h] = (int)(font->glyphs.size() - 1);
-
-    // Rasterize
-    dst = &texData[(glyph->x0 + pad) + (glyph->y0 + pad) * params.width];
-    fons__tt_renderGlyphBitmap(&renderFont->font, dst, gw - pad * 2,
-        gh - pad * 2, params.width, scale, scale, g);
-
-    // Make sure there is one pixel empty border.
-    dst = &texData[glyph->x0 + glyph->y0 * params.width];
-    for(y = 0; y < gh; y++)
-    {
-        dst[y * params.width] = 0;
-        dst[gw - 1 + y * params.width] = 0;
-    }
-    for(x = 0; x < gw; x++)
-    {
-        dst[x] = 0;
-        dst[x + (gh - 1) * params.width] = 0;
-    }
-
-    // Debug code to color the glyph background
-    /*	unsigned char* fdst = &texData[glyph->x0 + glyph->y0 * params.width];
-    for (y = 0; y < gh; y++) {
-    for (x = 0; x < gw; x++) {
-    int a = (int)fdst[x+y*params.width] + 20;
-    if (a > 255) a = 255;
-    fdst[x+y*params.width] = a;
-    }
-    }*/
-
-    // Blur
-    if(iblur > 0)
-    {
-        bdst = &texData[glyph->x0 + glyph->y0 * params.width];
-        fons__blur(bdst, gw, gh, params.width, iblur);
-    }
-
-    dirtyRect[0] = fons__mini(dirtyRect[0], glyph->x0);
-    dirtyRect[1] = fons__mini(dirtyRect[1], glyph->y0);
-    dirtyRect[2] = fons__maxi(dirtyRect[2], glyph->x1);
-    dirtyRect[3] = fons__maxi(dirtyRect[3], glyph->y1);
+    renderFont->metricsLut.fons__tableInsert({ (unsigned)g, isize, iblur },
+        (int)(renderFont->metrics.size() - 1));
 
     return glyph;
 }
 
+FONSglyph * FONScontext::fons__findMeasuredGlyph(
+    FONSfont *font,
+    unsigned int codepoint,
+    short isize,
+    short iblur)
+{
+    const unsigned int block = codepoint >> 8;
+    unsigned int entry;
+    int i, g;
+    float size = isize / 10.0f;
+    FONSfont *renderFont;
+
+    fons__glyphVariant(&isize, &iblur, &size);
+    if(block >= font->resolved.size() || !font->resolved[block])
+        return NULL;
+    entry = font->resolved[block][codepoint & 0xff];
+    if(entry == FONS_UNRESOLVED)
+        return NULL;
+    renderFont = &fonts[entry >> 16];
+    g = entry & 0xffff;
+    i = renderFont->lut.fons__tableFind(g, isize, iblur);
+    if(i != -1)
+        return &renderFont->glyphs[i];
+    i = renderFont->metricsLut.fons__tableFind(g, isize, iblur);
+    if(i != -1)
+        return &renderFont->metrics[i];
+    return NULL;
+}
+
 void FONScontext::fons__getQuad(
     FONSfont *font,
     int prevGlyphIndex,
     FONSglyph *glyph,
+    short isize,
     float scale,
     float spacing,
     float *x,
     float *y,
     FONSquad *q)
 {
-    float rx, ry, xoff, yoff, x0, y0, x1, y1;
+    float rx, ry, xoff, yoff, x0, y0, x1, y1, w, h;
+    float xadv = glyph->xadv / 10.0f;
 
     if(prevGlyphIndex != -1)
     {
-        float adv = fons__tt_getGlyphKernAdvance(&font->font, prevGlyphIndex,
-            glyph->index) * scale;
+        float adv = font->fons__getKern(prevGlyphIndex, glyph->index) *
+            scale;
         *x += (int)(adv + spacing + 0.5f);
     }
 
@@ -754,8 +2364,22 @@ void FONScontext::fons__getQuad(
     yoff = (short)(glyph->yoff + 1);
     x0 = (float)(glyph->x0 + 1);
     y0 = (float)(glyph->y0 + 1);
-    x1 = (float)(glyph->x1 - 1);
+    // The shadow channel is not part of the quad.
+    x1 = (float)(glyph->x0 + fons__glyphWidth(glyph) - 1);
     y1 = (float)(glyph->y1 - 1);
+    w = x1 - x0;
+    h = y1 - y0;
+
+    // Distance fields are stored at a single size.
+    if(params.flags & FONS_SDF)
+    {
+        const float k = (float)isize / glyph->size;
+        xoff *= k;
+        yoff *= k;
+        w *= k;
+        h *= k;
+        xadv *= k;
+    }
 
     if(params.flags & FONS_ZERO_TOPLEFT)
     {
@@ -764,8 +2388,8 @@ void FONScontext::fons__getQuad(
 
         q->x0 = rx;
         q->y0 = ry;
-        q->x1 = rx + x1 - x0;
-        q->y1 = ry + y1 - y0;
+        q->x1 = rx + w;
+        q->y1 = ry + h;
 
         q->s0 = x0 * itw;
         q->t0 = y0 * ith;
@@ -779,8 +2403,8 @@ void FONScontext::fons__getQuad(
 
         q->x0 = rx;
         q->y0 = ry;
-        q->x1 = rx + x1 - x0;
-        q->y1 = ry - y1 + y0;
+        q->x1 = rx + w;
+        q->y1 = ry - h;
 
         q->s0 = x0 * itw;
         q->t0 = y0 * ith;
@@ -788,7 +2412,181 @@ void FONScontext::fons__getQuad(
         q->t1 = y1 * ith;
     }
 
-    *x += (int)(glyph->xadv / 10.0f + 0.5f);
+    q->layer = glyph->page >= 0 ? pages[glyph->page].layer : 0;
+
+    *x += (int)(xadv + 0.5f);
+}
+
+void FONSring::fonsRingInit(
+    void *memory_,
+    int size_,
+    int framesInFlight_)
+{
+    memory = static_cast<unsigned char*>(memory_);
+    size = size_;
+    head = 0;
+    used = 0;
+    frame = 0;
+    frameBytes = 0;
+    pending.clear();
+    framesInFlight = framesInFlight_;
+    lastOffset = -1;
+    lastSize = 0;
+}
+
+void FONSring::fonsRingNextFrame()
+{
+    pending.emplace_back(frame, frameBytes);
+    ++frame;
+    frameBytes = 0;
+    lastOffset = -1;
+
+    // memory is reclaimed oldest frame first, so a frame that is not
+    // finished yet holds back the later ones
+    const int completed = completedFrame != NULL ?
+        completedFrame(fenceUptr) : frame - framesInFlight;
+    while(!pending.empty() && pending.front().first <= completed)
+    {
+        used -= pending.front().second;
+        pending.pop_front();
+    }
+}
+
+int FONSring::fonsRingOffset(const void *ptr) const
+{
+    const auto p = static_cast<const unsigned char*>(ptr);
+    if(p < memory || p >= memory + size)
+        return -1;
+    return (int)(p - memory);
+}
+
+void * FONSring::fons__ringAlloc(int bytes, int align)
+{
+    int offset, consumed;
+
+    if(bytes <= 0 || bytes > size)
+        return NULL;
+
+    offset = head;
+    if(offset % align != 0)
+        offset += align - offset % align;
+    // Skip the remainder of the ring if the allocation does not fit
+    // before its end. The skipped bytes belong to the current frame.
+    if(offset + bytes > size)
+        offset = 0;
+    consumed = offset >= head ?
+        offset + bytes - head : size - head + offset + bytes;
+
+    // Would overwrite memory still read by an in-flight frame.
+    if(used + consumed > size)
+        return NULL;
+
+    head = (offset + bytes) % size;
+    used += consumed;
+    frameBytes += consumed;
+    lastOffset = offset;
+    lastSize = bytes;
+
+    return memory + offset;
+}
+
+void FONSring::fons__ringCommit(void *ptr, int bytes)
+{
+    // Only the most recent allocation can give back its unused tail.
+    if(fonsRingOffset(ptr) != lastOffset)
+        return;
+
+    const int unused = lastSize - bytes;
+    head = (lastOffset + bytes) % size;
+    used -= unused;
+    frameBytes -= unused;
+    lastOffset = -1;
+}
+
+void * FONSring::fonsRingAlloc(void *uptr, int size, int align)
+{
+    return static_cast<FONSring*>(uptr)->fons__ringAlloc(size, align);
+}
+
+void FONSring::fonsRingCommit(void *uptr, void *ptr, int used)
+{
+    static_cast<FONSring*>(uptr)->fons__ringCommit(ptr, used);
+}
+
+template <typename T>
+T * FONScontext::fons__streamPush(FONSstream<T> &stream, int n)
+{
+    if(stream.count + n > stream.capacity)
+    {
+        if(params.streamAlloc != NULL)
+        {
+            // Draw the filled chunk before moving on to a new one.
+            if(stream.count > 0)
+                flush();
+            const int bytes = fons__maxi(n,
+                FONS_STREAM_CHUNK_SIZE / (int)sizeof(T)) * (int)sizeof(T);
+            void *mem = params.streamAlloc(params.streamUptr, bytes,
+                (int)sizeof(T));
+            if(mem != NULL)
+            {
+                stream.items = static_cast<T*>(mem);
+                stream.count = 0;
+                stream.capacity = bytes / (int)sizeof(T);
+                stream.external = true;
+            }
+        }
+        // No allocator or it ran out of space.
+        if(stream.count + n > stream.capacity)
+        {
+            stream.storage.resize(fons__maxi(stream.count + n,
+                fons__maxi((int)stream.storage.size() * 2, 256)));
+            stream.items = stream.storage.data();
+            stream.capacity = (int)stream.storage.size();
+        }
+    }
+
+    T *items = stream.items + stream.count;
+    stream.count += n;
+    return items;
+}
+
+template <typename T>
+void FONScontext::fons__streamReset(FONSstream<T> &stream)
+{
+    if(stream.external)
+    {
+        params.streamCommit(params.streamUptr, stream.items,
+            stream.count * (int)sizeof(T));
+        stream.items = nullptr;
+        stream.capacity = 0;
+        stream.external = false;
+    }
+    stream.count = 0;
+}
+
+template <typename T>
+void FONScontext::fons__streamReplay(
+    FONSstream<T> &stream,
+    const std::vector<T> &items)
+{
+    size_t i = 0, j;
+
+    while(i < items.size())
+    {
+        j = items.size();
+        if(params.flags & FONS_LAYER_BATCHES)
+        {
+            for(j = i + 1; j < items.size(); ++j)
+            {
+                if(items[j].layer != items[i].layer)
+                    break;
+            }
+            fons__beginLayer(items[i].layer);
+        }
+        std::copy(items.begin() + i, items.begin() + j,
+            fons__streamPush(stream, (int)(j - i)));
+        i = j;
+    }
 }
 
 void FONScontext::flush()
@@ -796,25 +2594,56 @@ void FONScontext::flush()
     // Flush texture
     if(dirtyRect[0] < dirtyRect[2] && dirtyRect[1] < dirtyRect[3])
     {
-        if(params.renderUpdate != NULL)
-            params.renderUpdate(params.userPtr, dirtyRect, texData.get());
-        // Reset dirty rect
-        dirtyRect[0] = params.width;
-        dirtyRect[1] = params.height;
-        dirtyRect[2] = 0;
-        dirtyRect[3] = 0;
+        const long long frameBytesBefore = frameUploadedBytes;
+        if(params.renderUpdateRects != NULL)
+        {
+            for(int layer = 0; layer < (int)texData.size(); ++layer)
+            {
+                const int n = fons__collectDirtyRects(layer);
+                if(n == 0)
+                    continue;
+                for(int i = 0; i < n * 4; i += 4)
+                {
+                    frameUploadedBytes += (long long)
+                        (dirtyRects[i + 2] - dirtyRects[i]) *
+                        (dirtyRects[i + 3] - dirtyRects[i + 1]);
+                }
+                params.renderUpdateRects(params.userPtr, layer,
+                    dirtyRects.data(), n, texData[layer].get());
+            }
+        }
+        else if(params.renderUpdate != NULL)
+        {
+            frameUploadedBytes += (long long)
+                (dirtyRect[2] - dirtyRect[0]) * (dirtyRect[3] - dirtyRect[1]);
+            params.renderUpdate(params.userPtr, dirtyRect, texData[0].get());
+        }
+        uploadedBytes += frameUploadedBytes - frameBytesBefore;
+        fons__resetDirty();
     }
 
     // Flush triangles
     if(!verts.empty())
     {
         if(params.renderDraw != NULL)
-            params.renderDraw(params.userPtr, verts.data(), tcoords.data(),
-                colors.data(), (int)(colors.size()));
-        verts.clear();
-        tcoords.clear();
-        colors.clear();
+            params.renderDraw(params.userPtr, verts.data(),
+                (int)verts.size());
+    }
+    if(!instances.empty())
+    {
+        if(params.renderDrawInstanced != NULL)
+            params.renderDrawInstanced(params.userPtr, instances.data(),
+                (int)instances.size());
     }
+    if(!shadowedInstances.empty())
+    {
+        if(params.renderDrawShadowed != NULL)
+            params.renderDrawShadowed(params.userPtr,
+                shadowedInstances.data(), (int)shadowedInstances.size());
+    }
+    fons__streamReset(verts);
+    fons__streamReset(instances);
+    fons__streamReset(shadowedInstances);
 }
 
 void FONScontext::vertex(
@@ -822,13 +2651,118 @@ void FONScontext::vertex(
     float y,
     float s,
     float t,
-    unsigned int c)
+    unsigned int c,
+    int layer,
+    float softness)
+{
+    // distance field quads are scaled by the font size and keep their
+    // fractional positions
+    if(params.flags & FONS_SDF)
+    {
+        x *= FONS_SDF_SUBPIXEL;
+        y *= FONS_SDF_SUBPIXEL;
+    }
+    const FONSvertex v = {
+        (short)fons__clampf(floorf(x + 0.5f), SHRT_MIN, SHRT_MAX),
+        (short)fons__clampf(floorf(y + 0.5f), SHRT_MIN, SHRT_MAX),
+        fons__unorm16(s),
+        fons__unorm16(t),
+        c,
+        (unsigned short)layer,
+        fons__unorm16(softness)
+    };
+    *fons__streamPush(verts, 1) = v;
+    if(layoutLog)
+        layoutLog->verts.push_back(v);
+}
+
+void FONScontext::quad(const FONSquad &q, unsigned int c, float softness)
+{
+    fons__beginQuads(0);
+    fons__beginLayer(q.layer);
+
+    if(params.renderDrawInstanced != NULL)
+    {
+        const FONSglyphInstance g = {
+            q.x0, q.y0, q.x1, q.y1,
+            q.s0, q.t0, q.s1, q.t1,
+            c,
+            (unsigned short)q.layer,
+            fons__unorm16(softness)
+        };
+        *fons__streamPush(instances, 1) = g;
+        if(layoutLog)
+            layoutLog->instances.push_back(g);
+        return;
+    }
+
+    vertex(q.x0, q.y0, q.s0, q.t0, c, q.layer, softness);
+    vertex(q.x1, q.y1, q.s1, q.t1, c, q.layer, softness);
+    vertex(q.x1, q.y0, q.s1, q.t0, c, q.layer, softness);
+
+    vertex(q.x0, q.y0, q.s0, q.t0, c, q.layer, softness);
+    vertex(q.x0, q.y1, q.s0, q.t1, c, q.layer, softness);
+    vertex(q.x1, q.y1, q.s1, q.t1, c, q.layer, softness);
+}
+
+void FONScontext::shadowedQuad(
+    const FONSquad &q,
+    unsigned int c,
+    unsigned int shadowColor,
+    float k,
+    float channel)
 {
-    verts.push_back(x);
-    verts.push_back(y);
-    tcoords.push_back(s);
-    tcoords.push_back(t);
-    colors.push_back(c);
+    const FONSstate *state = getState();
+    // Texture coordinates per pixel, v follows the direction of the quad.
+    const float du = itw / k;
+    const float dv = ith / k;
+    const float sign = q.y1 < q.y0 ? -1.0f : 1.0f;
+    // Margin for the shadow around the glyph. Bitmap glyphs are already
+    // padded for the blur of their shadow channel.
+    const float spread = params.flags & FONS_SDF ? state->shadow_blur : 0;
+    const float mx = fabsf(state->shadow_x) + spread;
+    const float my = fabsf(state->shadow_y) + spread;
+
+    fons__beginQuads(1);
+    fons__beginLayer(q.layer);
+    const FONSshadowedGlyphInstance g = {
+        q.x0 - mx, q.y0 - my * sign, q.x1 + mx, q.y1 + my * sign,
+        q.s0 - mx * du, q.t0 - my * dv, q.s1 + mx * du, q.t1 + my * dv,
+        c,
+        (unsigned short)q.layer,
+        fons__unorm16(fons__sdfSoftness(state->blur, k)),
+        q.s0, q.t0, q.s1, q.t1,
+        state->shadow_x * du, state->shadow_y * dv * sign,
+        fons__sdfSoftness(state->shadow_blur, k),
+        channel,
+        shadowColor
+    };
+    *fons__streamPush(shadowedInstances, 1) = g;
+    if(layoutLog)
+        layoutLog->shadowedInstances.push_back(g);
+}
+
+int FONScontext::fons__singlePassShadow(const FONSstate *state)
+{
+    return (state->shadow_color & 0xff000000) != 0 &&
+        params.renderDrawShadowed != NULL;
+}
+
+void FONScontext::fons__beginQuads(int shadowed)
+{
+    if(shadowed ?
+        !verts.empty() || !instances.empty() :
+        !shadowedInstances.empty())
+        flush();
+}
+
+void FONScontext::fons__beginLayer(int layer)
+{
+    if(!(params.flags & FONS_LAYER_BATCHES) || layer == batchLayer)
+        return;
+    if(!verts.empty() || !instances.empty() || !shadowedInstances.empty())
+        flush();
+    batchLayer = layer;
 }
 
 float FONScontext::getVerticalAlign(FONSfont *font, int align, short isize)
@@ -896,14 +2830,41 @@ float FONScontext::drawText(
     float scale;
     FONSfont *font;
     float width;
+    const bool shadow = (state->shadow_color & 0xff000000) != 0;
+    const bool singlePass = fons__singlePassShadow(state) != 0;
 
     if(state->font < 0 || state->font >= fonts.size())
         USAGI_THROW(std::runtime_error("invalid font index"));
 
     font = &fonts[state->font];
-    if(font->data.empty())
+    if(!fons__loadFont(font))
         USAGI_THROW(std::runtime_error("invalid font data"));
 
+    // Draw the shadow as a blurred copy of the text first.
+    if(shadow && !singlePass)
+    {
+        const FONSstate text = *state;
+        state->color = text.shadow_color;
+        state->blur = text.shadow_blur;
+        state->shadow_color = 0;
+        drawText(str,
+            bound.translated(usagi::Vector2f { text.shadow_x, text.shadow_y }),
+            transition_begin, transition_end);
+        *state = text;
+        state->shadow_color = 0;
+        const float advance = drawText(str, bound,
+            transition_begin, transition_end);
+        *state = text;
+        return advance;
+    }
+
+    // Bitmap glyphs bring their shadow along.
+    if(singlePass && !(params.flags & FONS_SDF))
+        iblur = fons__shadowKey(iblur, state->shadow_blur);
+
+    // Rasterize the missing glyphs together before laying them out.
+    fons__prefetchGlyphs(font, str, isize, iblur);
+
     scale = fons__tt_getPixelHeightScale(&font->font, (float)isize / 10.0f);
 
     // Align horizontally
@@ -936,30 +2897,33 @@ float FONScontext::drawText(
     for(auto &&codepoint : str)
     {
         uint8_t alpha = (state->color & 0xff000000) >> 24;
+        uint8_t shadow_alpha = (state->shadow_color & 0xff000000) >> 24;
 
         if(tBeginPos != tEndPos)
         {
             if(i >= tEndPos)
             {
                 alpha = 0;
+                shadow_alpha = 0;
             }
             else if(i >= tBeginPos)
             {
-                alpha = usagi::lerp(
-                    usagi::lerpCoefficient(i, tBeginPos, tEndPos),
-                    alpha,
-                    uint8_t(0));
+                const float t = usagi::lerpCoefficient(i, tBeginPos, tEndPos);
+                alpha = usagi::lerp(t, alpha, uint8_t(0));
+                shadow_alpha = usagi::lerp(t, shadow_alpha, uint8_t(0));
             }
         }
 
         uint32_t real_color = state->color & 0x00ffffff;
         real_color |= alpha << 24;
+        uint32_t real_shadow_color = state->shadow_color & 0x00ffffff;
+        real_shadow_color |= shadow_alpha << 24;
 
         glyph = getGlyph(font, codepoint, isize, iblur);
 
         if(glyph != NULL)
         {
-            fons__getQuad(font, prevGlyphIndex, glyph, scale,
+            fons__getQuad(font, prevGlyphIndex, glyph, isize, scale,
                 state->spacing, &x, &y, &q);
             if(x > bound.max().x())
             {
@@ -967,17 +2931,31 @@ float FONScontext::drawText(
                 fonsVertMetrics(nullptr, nullptr, &lh);
                 y += lh + getState()->line_spacing;
                 x = bound.min().x();
-                fons__getQuad(font, prevGlyphIndex, glyph, scale,
+                fons__getQuad(font, prevGlyphIndex, glyph, isize, scale,
                     state->spacing, &x, &y, &q);
             }
 
-            vertex(q.x0, q.y0, q.s0, q.t0, real_color);
-            vertex(q.x1, q.y1, q.s1, q.t1, real_color);
-            vertex(q.x1, q.y0, q.s1, q.t0, real_color);
-
-            vertex(q.x0, q.y0, q.s0, q.t0, real_color);
-            vertex(q.x0, q.y1, q.s0, q.t1, real_color);
-            vertex(q.x1, q.y1, q.s1, q.t1, real_color);
+            // Glyphs still being loaded only take up their space.
+            if(glyph->page < 0)
+            {
+                // empty
+            }
+            else if(singlePass)
+            {
+                const float channel = params.flags & FONS_SDF ?
+                    0 : fons__glyphWidth(glyph) * itw;
+                shadowedQuad(q, real_color, real_shadow_color,
+                    (float)isize / glyph->size, channel);
+            }
+            else if(params.flags & FONS_SDF)
+            {
+                quad(q, real_color, fons__sdfSoftness(state->blur,
+                    (float)isize / glyph->size));
+            }
+            else
+            {
+                quad(q, real_color);
+            }
         }
         prevGlyphIndex = glyph != NULL ? glyph->index : -1;
         i += 1;
@@ -985,79 +2963,240 @@ float FONScontext::drawText(
     return x;
 }
 
-void FONScontext::fonsDrawDebug(float x, float y)
+bool fons__sameState(const FONSstate &a, const FONSstate &b)
+{
+    return a.font == b.font &&
+        a.align == b.align &&
+        a.size == b.size &&
+        a.color == b.color &&
+        a.blur == b.blur &&
+        a.spacing == b.spacing &&
+        a.line_spacing == b.line_spacing &&
+        a.shadow_color == b.shadow_color &&
+        a.shadow_x == b.shadow_x &&
+        a.shadow_y == b.shadow_y &&
+        a.shadow_blur == b.shadow_blur;
+}
+
+float FONScontext::drawTextCached(
+    FONSlayout &layout,
+    std::u32string_view str,
+    const usagi::AlignedBox2f &bound,
+    float transition_begin,
+    float transition_end)
+{
+    FONSstate *state = getState();
+
+    const bool valid = layout.generation == atlasGeneration &&
+        layout.transition_begin == transition_begin &&
+        layout.transition_end == transition_end &&
+        layout.bound.min() == bound.min() &&
+        layout.bound.max() == bound.max() &&
+        fons__sameState(layout.state, *state) &&
+        layout.text == str;
+
+    fons__beginQuads(fons__singlePassShadow(state));
+
+    if(!valid)
+    {
+        const int generation = atlasGeneration;
+        layout.pages.clear();
+        layout.verts.clear();
+        layout.instances.clear();
+        layout.shadowedInstances.clear();
+        pageLog = &layout.pages;
+        layoutLog = &layout;
+        layout.advance = drawText(str, bound,
+            transition_begin, transition_end);
+        pageLog = nullptr;
+        layoutLog = nullptr;
+
+        layout.text = str;
+        layout.state = *state;
+        layout.bound = bound;
+        layout.transition_begin = transition_begin;
+        layout.transition_end = transition_end;
+        layout.generation = -1;
+
+        // Glyphs rasterized during layout may have expanded the atlas,
+        // which makes the texture coordinates of the earlier glyphs stale.
+        // Record next time.
+        if(generation != atlasGeneration)
+        {
+            layout.verts.clear();
+            layout.instances.clear();
+            layout.shadowedInstances.clear();
+            return layout.advance;
+        }
+
+        layout.generation = atlasGeneration;
+        std::sort(layout.pages.begin(), layout.pages.end());
+        layout.pages.erase(
+            std::unique(layout.pages.begin(), layout.pages.end()),
+            layout.pages.end());
+
+        return layout.advance;
+    }
+
+    for(auto &&page : layout.pages)
+        pages[page].lastUsed = frame;
+    fons__streamReplay(verts, layout.verts);
+    fons__streamReplay(instances, layout.instances);
+    fons__streamReplay(shadowedInstances, layout.shadowedInstances);
+
+    return layout.advance;
+}
+
+void FONScontext::fonsDrawDebug(float x, float y)
+{
+    int i;
+    int w = params.width;
+    int h = params.height;
+    float u = w == 0 ? 0 : (1.0f / w);
+    float v = h == 0 ? 0 : (1.0f / h);
+
+    // Layers are stacked vertically.
+    for(i = 0; i < (int)texData.size(); i++)
+    {
+        const float ly = y + i * h;
+
+        // Draw background
+        quad({ x + 0, ly + 0, u, v, x + w, ly + h, u, v, 0 }, 0x0fffffff);
+
+        // Draw texture
+        quad({ x + 0, ly + 0, 0, 0, x + w, ly + h, 1, 1, i }, 0xffffffff);
+    }
+
+    // Drawbug draw atlas
+    for(auto &&page : pages)
+    {
+        for(i = 0; i < page.atlas.nodes.size(); i++)
+        {
+            FONSatlasNode *n = &page.atlas.nodes[i];
+            const float ny = y + page.layer * h + page.y + n->y;
+
+            quad({
+                x + n->x + 0, ny + 0, u, v,
+                x + n->x + n->width, ny + 1, u, v,
+                page.layer
+            }, 0xc00000ff);
+        }
+    }
+
+    // fons__flush(stash);
+}
+
+float FONScontext::fonsTextBounds(
+    float x,
+    float y,
+    std::u32string_view str,
+    float *bounds)
+{
+    FONSmeasureSetup setup;
+    float advance;
+
+    fons__measureSetup(getState(), &setup);
+    fons__measureText(&setup, x, y, str, bounds, &advance, 0);
+
+    return advance;
+}
+
+void FONScontext::fonsTextBoundsBatch(
+    const FONSmeasureItem *items,
+    int count,
+    float *bounds,
+    float *advances)
 {
+    // Strings measured by each worker task.
+    const int chunk = 64;
+    float advance;
     int i;
-    int w = params.width;
-    int h = params.height;
-    float u = w == 0 ? 0 : (1.0f / w);
-    float v = h == 0 ? 0 : (1.0f / h);
-
-    // Draw background
-    vertex(x + 0, y + 0, u, v, 0x0fffffff);
-    vertex(x + w, y + h, u, v, 0x0fffffff);
-    vertex(x + w, y + 0, u, v, 0x0fffffff);
-
-    vertex(x + 0, y + 0, u, v, 0x0fffffff);
-    vertex(x + 0, y + h, u, v, 0x0fffffff);
-    vertex(x + w, y + h, u, v, 0x0fffffff);
-
-    // Draw texture
-    vertex(x + 0, y + 0, 0, 0, 0xffffffff);
-    vertex(x + w, y + h, 1, 1, 0xffffffff);
-    vertex(x + w, y + 0, 1, 0, 0xffffffff);
 
-    vertex(x + 0, y + 0, 0, 0, 0xffffffff);
-    vertex(x + 0, y + h, 0, 1, 0xffffffff);
-    vertex(x + w, y + h, 1, 1, 0xffffffff);
+    measureSetups.resize(count);
+    for(i = 0; i < count; i++)
+    {
+        const FONSstate *state = items[i].state;
+        const FONSmeasureSetup *prev = i > 0 ? &measureSetups[i - 1] : NULL;
+        if(prev != NULL && state->font == prev->font - fonts.data() &&
+            (short)(state->size * 10.0f) == prev->isize &&
+            (short)state->blur == prev->iblur &&
+            state->spacing == prev->spacing && state->align == prev->align)
+            measureSetups[i] = *prev;
+        else
+            fons__measureSetup(state, &measureSetups[i]);
+    }
 
-    // Drawbug draw atlas
-    for(i = 0; i < atlas.nodes.size(); i++)
+    // Lookups only read the caches, strings that would fill them are
+    // measured again below.
+    measureMissed.assign(count, 1);
+    if(!workers.threads.empty())
+    {
+        workers.fons__workersFor((count + chunk - 1) / chunk, [&](int c) {
+            float a;
+            const int end = std::min(count, (c + 1) * chunk);
+            for(int j = c * chunk; j < end; j++)
+            {
+                if(!fons__measureText(&measureSetups[j], 0, 0, items[j].str,
+                    bounds ? bounds + j * 4 : NULL, &a, 1))
+                    continue;
+                if(advances)
+                    advances[j] = a;
+                measureMissed[j] = 0;
+            }
+        });
+    }
+    for(i = 0; i < count; i++)
     {
-        FONSatlasNode *n = &atlas.nodes[i];
+        if(!measureMissed[i])
+            continue;
+        fons__measureText(&measureSetups[i], 0, 0, items[i].str,
+            bounds ? bounds + i * 4 : NULL, &advance, 0);
+        if(advances)
+            advances[i] = advance;
+    }
+}
 
-        vertex(x + n->x + 0, y + n->y + 0, u, v, 0xc00000ff);
-        vertex(x + n->x + n->width, y + n->y + 1, u, v,
-            0xc00000ff);
-        vertex(x + n->x + n->width, y + n->y + 0, u, v,
-            0xc00000ff);
+void FONScontext::fons__measureSetup(
+    const FONSstate *state,
+    FONSmeasureSetup *setup)
+{
+    FONSfont *font;
 
-        vertex(x + n->x + 0, y + n->y + 0, u, v, 0xc00000ff);
-        vertex(x + n->x + 0, y + n->y + 1, u, v, 0xc00000ff);
-        vertex(x + n->x + n->width, y + n->y + 1, u, v,
-            0xc00000ff);
-    }
+    if(state->font < 0 || state->font >= fonts.size())
+        USAGI_THROW(std::runtime_error("invalid font index"));
+    font = &fonts[state->font];
+    if(!fons__loadFont(font))
+        USAGI_THROW(std::runtime_error("invalid font data"));
 
-    // fons__flush(stash);
+    setup->font = font;
+    setup->isize = (short)(state->size * 10.0f);
+    setup->iblur = (short)state->blur;
+    setup->scale = fons__tt_getPixelHeightScale(&font->font,
+        (float)setup->isize / 10.0f);
+    setup->spacing = state->spacing;
+    setup->align = state->align;
+    setup->baseline = getVerticalAlign(font, state->align, setup->isize);
 }
 
-float FONScontext::fonsTextBounds(
+int FONScontext::fons__measureText(
+    const FONSmeasureSetup *setup,
     float x,
     float y,
     std::u32string_view str,
-    float *bounds)
+    float *bounds,
+    float *advance,
+    int shared)
 {
-    FONSstate *state = getState();
+    FONSfont *font = setup->font;
     FONSquad q;
     FONSglyph *glyph = NULL;
     int prevGlyphIndex = -1;
-    short isize = (short)(state->size * 10.0f);
-    short iblur = (short)state->blur;
-    float scale;
-    FONSfont *font;
-    float startx, advance;
+    int kern;
+    float startx;
     float minx, miny, maxx, maxy;
 
-    if(state->font < 0 || state->font >= fonts.size())
-        USAGI_THROW(std::runtime_error("invalid font index"));
-    font = &fonts[state->font];
-    if(font->data.empty())
-        USAGI_THROW(std::runtime_error("invalid font data"));
-
-    scale = fons__tt_getPixelHeightScale(&font->font, (float)isize / 10.0f);
-
     // Align vertically.
-    y += getVerticalAlign(font, state->align, isize);
+    y += setup->baseline;
 
     minx = maxx = x;
     miny = maxy = y;
@@ -1065,11 +3204,37 @@ float FONScontext::fonsTextBounds(
 
     for(auto &&codepoint : str)
     {
-        glyph = getGlyph(font, codepoint, isize, iblur);
+        if(setup->isize < 2)
+        {
+            glyph = NULL;
+        }
+        else if(shared)
+        {
+            glyph = fons__findMeasuredGlyph(font, codepoint, setup->isize,
+                setup->iblur);
+            if(glyph == NULL)
+                return 0;
+        }
+        else
+        {
+            glyph = fons__measureGlyph(font, codepoint, setup->isize,
+                setup->iblur);
+        }
         if(glyph != NULL)
         {
-            fons__getQuad(font, prevGlyphIndex, glyph, scale,
-                state->spacing, &x, &y, &q);
+            // Kerning is applied here instead of by fons__getQuad() so that
+            // shared measuring does not fill the kerning cache.
+            if(prevGlyphIndex != -1)
+            {
+                if(!shared)
+                    kern = font->fons__getKern(prevGlyphIndex, glyph->index);
+                else if(!font->fons__findKern(prevGlyphIndex, glyph->index,
+                    &kern))
+                    return 0;
+                x += (int)(kern * setup->scale + setup->spacing + 0.5f);
+            }
+            fons__getQuad(font, -1, glyph, setup->isize, setup->scale,
+                setup->spacing, &x, &y, &q);
             if(q.x0 < minx) minx = q.x0;
             if(q.x1 > maxx) maxx = q.x1;
             if(params.flags & FONS_ZERO_TOPLEFT)
@@ -1086,22 +3251,22 @@ float FONScontext::fonsTextBounds(
         prevGlyphIndex = glyph != NULL ? glyph->index : -1;
     }
 
-    advance = x - startx;
+    *advance = x - startx;
 
     // Align horizontally
-    if(state->align & FONS_ALIGN_LEFT)
+    if(setup->align & FONS_ALIGN_LEFT)
     {
         // empty
     }
-    else if(state->align & FONS_ALIGN_RIGHT)
+    else if(setup->align & FONS_ALIGN_RIGHT)
     {
-        minx -= advance;
-        maxx -= advance;
+        minx -= *advance;
+        maxx -= *advance;
     }
-    else if(state->align & FONS_ALIGN_CENTER)
+    else if(setup->align & FONS_ALIGN_CENTER)
     {
-        minx -= advance * 0.5f;
-        maxx -= advance * 0.5f;
+        minx -= *advance * 0.5f;
+        maxx -= *advance * 0.5f;
     }
 
     if(bounds)
@@ -1112,7 +3277,7 @@ float FONScontext::fonsTextBounds(
         bounds[3] = maxy;
     }
 
-    return advance;
+    return 1;
 }
 
 void FONScontext::fonsVertMetrics(
@@ -1129,7 +3294,7 @@ void FONScontext::fonsVertMetrics(
             runtime_error("invalid font index"));
     font = &fonts[state->font];
     isize = (short)(state->size * 10.0f);
-    if(font->data.empty()) return;
+    if(!fons__loadFont(font)) return;
 
     if(ascender)
         *ascender = font->ascender * isize / 10.0f;
@@ -1149,7 +3314,7 @@ void FONScontext::fonsLineBounds(float y, float *miny, float *maxy)
             runtime_error("invalid font index"));
     font = &fonts[state->font];
     isize = (short)(state->size * 10.0f);
-    if(font->data.empty()) return;
+    if(!fons__loadFont(font)) return;
 
     y += getVerticalAlign(font, state->align, isize);
 
@@ -1171,7 +3336,12 @@ const unsigned char * FONScontext::fonsGetTextureData(int *width, int *height)
         *width = params.width;
     if(height != NULL)
         *height = params.height;
-    return texData.get();
+    return texData[0].get();
+}
+
+float FONScontext::fonsVertexScale() const
+{
+    return params.flags & FONS_SDF ? 1.0f / FONS_SDF_SUBPIXEL : 1.0f;
 }
 
 int FONScontext::fonsValidateTexture(int *dirty)
@@ -1182,18 +3352,23 @@ int FONScontext::fonsValidateTexture(int *dirty)
         dirty[1] = dirtyRect[1];
         dirty[2] = dirtyRect[2];
         dirty[3] = dirtyRect[3];
-        // Reset dirty rect
-        dirtyRect[0] = params.width;
-        dirtyRect[1] = params.height;
-        dirtyRect[2] = 0;
-        dirtyRect[3] = 0;
+        fons__resetDirty();
         return 1;
     }
     return 0;
 }
 
+void FONScontext::fonsSetErrorCallback(
+    void (*callback)(void *uptr, int error, int val),
+    void *uptr)
+{
+    handleError = callback;
+    errorUptr = uptr;
+}
+
 FONScontext::~FONScontext()
 {
+    workers.fons__workersStop();
     if(params.renderDelete)
         params.renderDelete(params.userPtr);
 }
@@ -1211,10 +3386,21 @@ int FONScontext::fonsExpandAtlas(int width, int height)
 
     width = fons__maxi(width, params.width);
     height = fons__maxi(height, params.height);
+    // With a budget, grow by whole pages up to the budget.
+    if(params.atlasBudget > 0)
+    {
+        width = params.width;
+        height = fons__maxi(fons__clampAtlasHeight(width, height),
+            params.height);
+    }
 
     if(width == params.width && height == params.height)
         return 1;
 
+    // Layers are fixed in size, existing glyphs stay put.
+    if(params.renderAddPage != NULL)
+        return fons__addPage();
+
     // Flush pending glyphs.
     flush();
 
@@ -1229,7 +3415,7 @@ int FONScontext::fonsExpandAtlas(int width, int height)
     for(i = 0; i < params.height; i++)
     {
         unsigned char *dst = &newdata[i * width];
-        unsigned char *src = &texData[i * params.width];
+        unsigned char *src = &texData[0][i * params.width];
         memcpy(dst, src, params.width);
         if(width > params.width)
             memset(dst + params.width, 0, width - params.width);
@@ -1238,34 +3424,57 @@ int FONScontext::fonsExpandAtlas(int width, int height)
         memset(&newdata[params.height * width], 0,
             (height - params.height) * width);
 
-    texData.reset(newdata.release());
+    texData[0].reset(newdata.release());
 
     // Increase atlas size
-    atlas.fons__atlasExpand(width, height);
-
-    // Add existing data as dirty.
-    for(i = 0; i < atlas.nodes.size(); i++)
-        maxy = fons__maxi(maxy, atlas.nodes[i].y);
-    dirtyRect[0] = 0;
-    dirtyRect[1] = 0;
-    dirtyRect[2] = params.width;
-    dirtyRect[3] = maxy;
+    if(params.atlasBudget > 0)
+    {
+        for(i = params.height; i < height; i += FONS_ATLAS_PAGE_HEIGHT)
+        {
+            FONSatlasPage &page = pages.emplace_back();
+            page.atlas.fons__atlasReset(width, FONS_ATLAS_PAGE_HEIGHT);
+            page.layer = 0;
+            page.y = i;
+            page.lastUsed = INT_MIN;
+        }
+    }
+    else
+    {
+        pages[0].atlas.fons__atlasExpand(width, height);
+    }
 
+    const int oldWidth = params.width;
     params.width = width;
     params.height = height;
     itw = 1.0f / params.width;
     ith = 1.0f / params.height;
+    ++atlasGeneration;
+
+    // Add existing data as dirty.
+    for(auto &&page : pages)
+    {
+        for(auto &&node : page.atlas.nodes)
+        {
+            if(node.y > 0)
+                maxy = fons__maxi(maxy, page.y + node.y);
+        }
+    }
+    fons__resetDirty();
+    if(maxy > 0)
+        fons__markDirty(0, 0, 0, oldWidth, maxy);
 
     return 1;
 }
 
 int FONScontext::fonsResetAtlas(int width, int height)
 {
-    int i, j;
+    int i;
 
     // Flush pending glyphs.
     flush();
 
+    height = fons__clampAtlasHeight(width, height);
+
     // Create new texture
     if(params.renderResize != NULL)
     {
@@ -1274,33 +3483,531 @@ int FONScontext::fonsResetAtlas(int width, int height)
     }
 
     // Reset atlas
-    atlas.fons__atlasReset(width, height);
-
-    // Clear texture data.
-    texData.reset(new unsigned char[width * height]);
-    memset(texData.get(), 0, width * height);
-    // Reset dirty rect
-    dirtyRect[0] = width;
-    dirtyRect[1] = height;
-    dirtyRect[2] = 0;
-    dirtyRect[3] = 0;
+    fons__buildPages(width, height);
+
+    // Clear texture data, back to a single layer.
+    texData.clear();
+    texData.emplace_back(new unsigned char[width * height]);
+    memset(texData[0].get(), 0, width * height);
 
     // Reset cached glyphs
     for(i = 0; i < fonts.size(); i++)
     {
         FONSfont *font = &fonts[i];
         font->glyphs.clear();
-        for(j = 0; j < FONS_HASH_LUT_SIZE; j++)
-            font->lut[j] = -1;
+        font->lut.fons__tableClear();
+        font->metrics.clear();
+        font->metricsLut.fons__tableClear();
     }
 
     params.width = width;
     params.height = height;
     itw = 1.0f / params.width;
     ith = 1.0f / params.height;
+    ++atlasGeneration;
+    fons__resetDirty();
 
     // Add white rect at 0,0 for debug drawing.
     fons__addWhiteRect(2, 2);
 
     return 1;
 }
+
+int FONSmappedFile::fons__mapFile(const std::filesystem::path &path)
+{
+    fons__unmapFile();
+#ifdef _WIN32
+    HANDLE file, mapping;
+    LARGE_INTEGER fileSize;
+
+    file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(file == INVALID_HANDLE_VALUE)
+        return 0;
+    if(!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0)
+    {
+        CloseHandle(file);
+        return 0;
+    }
+    // The view keeps the file and the mapping alive.
+    mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if(mapping == NULL)
+        return 0;
+    data = (const unsigned char *)MapViewOfFile(mapping, FILE_MAP_READ,
+        0, 0, 0);
+    CloseHandle(mapping);
+    if(data == NULL)
+        return 0;
+    size = (size_t)fileSize.QuadPart;
+#else
+    struct stat st;
+    void *view;
+    int fd;
+
+    fd = open(path.c_str(), O_RDONLY);
+    if(fd < 0)
+        return 0;
+    if(fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        close(fd);
+        return 0;
+    }
+    view = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(view == MAP_FAILED)
+        return 0;
+    data = (const unsigned char *)view;
+    size = (size_t)st.st_size;
+#endif
+    return 1;
+}
+
+void FONSmappedFile::fons__unmapFile()
+{
+    if(data == NULL)
+        return;
+#ifdef _WIN32
+    UnmapViewOfFile(data);
+#else
+    munmap((void *)data, size);
+#endif
+    data = NULL;
+    size = 0;
+}
+
+FONSmappedFile::~FONSmappedFile()
+{
+    fons__unmapFile();
+}
+
+// Atlas cache file layout, all in native byte order:
+//   FONScacheHeader
+//   per font: identity hash, see fons__fontHash(), 0 without glyphs
+//   per page: layer, y, width, height, pinned, node count, nodes
+//   per font: glyph count, glyphs
+//   pixels of each layer
+struct FONScacheHeader
+{
+    char magic[8];
+    unsigned int version;
+    // Hash of everything the cache depends on, see fons__cacheKey().
+    unsigned long long key;
+    // Hash of what the glyph bitmaps depend on, see fons__baseKey().
+    unsigned long long baseKey;
+    int width, height;
+    int layers;
+    int pages;
+    int fonts;
+};
+
+// Parsed and validated cache, pixels point into the cache data.
+struct FONScacheData
+{
+    FONScacheHeader header;
+    std::vector<unsigned long long> fontHashes;
+    std::vector<FONSatlasPage> pages;
+    std::vector<std::vector<FONSglyph>> glyphs;
+    const unsigned char *pixels;
+};
+
+static unsigned long long fons__hash(
+    unsigned long long h,
+    const void *data,
+    size_t size)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    for(size_t i = 0; i < size; ++i)
+        h = (h ^ p[i]) * 1099511628211ull;
+    return h;
+}
+
+static int fons__cacheRead(
+    const unsigned char **p,
+    const unsigned char *end,
+    void *dst,
+    size_t size)
+{
+    if((size_t)(end - *p) < size)
+        return 0;
+    if(size > 0)
+        memcpy(dst, *p, size);
+    *p += size;
+    return 1;
+}
+
+static void fons__cacheWrite(std::ostream &out, const void *src, size_t size)
+{
+    out.write((const char *)src, (std::streamsize)size);
+}
+
+// Checks that data is a well-formed cache, without comparing it to any
+// context.
+static int fons__parseCache(
+    const unsigned char *data,
+    size_t size,
+    FONScacheData *cache)
+{
+    FONScacheHeader &header = cache->header;
+    const unsigned char *p = data, *end = data + size;
+    size_t layerSize;
+    int i, n;
+
+    if(!fons__cacheRead(&p, end, &header, sizeof(header)) ||
+        memcmp(header.magic, FONS_CACHE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != FONS_CACHE_VERSION ||
+        header.width <= 0 || header.height <= 0 ||
+        header.width > SHRT_MAX || header.height > SHRT_MAX ||
+        header.layers < 1 || header.pages < 1 || header.fonts < 0)
+        return 0;
+    layerSize = (size_t)header.width * header.height;
+    if((size_t)header.layers > size / layerSize ||
+        (size_t)header.pages > size / (6 * sizeof(int)) ||
+        (size_t)header.fonts > size / (2 * sizeof(int)))
+        return 0;
+
+    cache->fontHashes.resize(header.fonts);
+    if(!fons__cacheRead(&p, end, cache->fontHashes.data(),
+        header.fonts * sizeof(unsigned long long)))
+        return 0;
+
+    cache->pages.resize(header.pages);
+    for(i = 0; i < header.pages; i++)
+    {
+        FONSatlasPage &page = cache->pages[i];
+        int fields[6];
+        if(!fons__cacheRead(&p, end, fields, sizeof(fields)))
+            return 0;
+        page.layer = fields[0];
+        page.y = fields[1];
+        page.atlas.width = fields[2];
+        page.atlas.height = fields[3];
+        page.pinned = fields[4];
+        n = fields[5];
+        if(page.layer < 0 || page.layer >= header.layers ||
+            page.y < 0 || page.atlas.height < 0 ||
+            page.y + page.atlas.height > header.height ||
+            page.atlas.width != header.width ||
+            n < 1 || n > header.width)
+            return 0;
+        page.atlas.nodes.resize(n);
+        if(!fons__cacheRead(&p, end, page.atlas.nodes.data(),
+            n * sizeof(FONSatlasNode)))
+            return 0;
+        for(auto &&node : page.atlas.nodes)
+        {
+            if(node.x < 0 || node.width < 0 ||
+                node.x + node.width > page.atlas.width ||
+                node.y < 0 || node.y > page.atlas.height)
+                return 0;
+        }
+    }
+
+    cache->glyphs.resize(header.fonts);
+    for(i = 0; i < header.fonts; i++)
+    {
+        if(!fons__cacheRead(&p, end, &n, sizeof(n)) || n < 0 ||
+            (size_t)n > (size_t)(end - p) / sizeof(FONSglyph))
+            return 0;
+        cache->glyphs[i].resize(n);
+        if(!fons__cacheRead(&p, end, cache->glyphs[i].data(),
+            n * sizeof(FONSglyph)))
+            return 0;
+        // Glyphs lie within the page they belong to, evicting it frees
+        // them along with their rows.
+        for(auto &&g : cache->glyphs[i])
+        {
+            if(g.page < 0 || g.page >= header.pages)
+                return 0;
+            const FONSatlasPage &page = cache->pages[g.page];
+            if(g.x0 < 0 || g.x1 < g.x0 || g.x1 > page.atlas.width ||
+                g.y0 < page.y || g.y1 < g.y0 ||
+                g.y1 > page.y + page.atlas.height)
+                return 0;
+        }
+    }
+
+    if((size_t)(end - p) != layerSize * header.layers)
+        return 0;
+    cache->pixels = p;
+
+    return 1;
+}
+
+unsigned long long FONScontext::fons__fontHash(int font)
+{
+    FONSfont *f = &fonts[font];
+    std::shared_ptr<const FONSfontData> data;
+    unsigned long long size;
+    size_t n;
+
+    if(f->dataHash != 0)
+        return f->dataHash;
+    // Fonts not used yet are only mapped, not parsed. The mapping is
+    // dropped again unless another context holds on to it.
+    data = f->data;
+    if(!data && !f->loadFailed)
+        data = fonsMapFontData(f->path);
+    if(!data)
+        return 0;
+
+    // The font is identified by its size and its sfnt table directory,
+    // which holds a checksum of every table. Hashing the whole file would
+    // read in all of a mapped font.
+    size = data->size;
+    n = size;
+    if(size >= 12)
+        n = std::min<size_t>(size, 12 + 16 * fons__readU16(data->data + 4));
+    f->dataHash = fons__hash(14695981039346656037ull, &size, sizeof(size));
+    f->dataHash = fons__hash(f->dataHash, data->data, n);
+    return f->dataHash;
+}
+
+unsigned long long FONScontext::fons__baseKey()
+{
+    const int config[] = {
+        FONS_CACHE_VERSION, (int)sizeof(FONSglyph), params.flags & FONS_SDF,
+        FONS_SDF_SIZE, FONS_SDF_PADDING
+    };
+
+    return fons__hash(14695981039346656037ull, config, sizeof(config));
+}
+
+unsigned long long FONScontext::fons__cacheKey()
+{
+    const int config[] = {
+        params.flags, params.atlasBudget, params.renderAddPage != NULL,
+        FONS_ATLAS_PAGE_HEIGHT, (int)fonts.size()
+    };
+
+    // The fonts are compared one by one, only those owning glyphs.
+    return fons__hash(fons__baseKey(), config, sizeof(config));
+}
+
+void FONScontext::fons__writeCache(std::ostream &out)
+{
+    FONScacheHeader header;
+    unsigned long long hash;
+    int i, n;
+
+    // Glyphs still being loaded are left out.
+    fons__waitGlyphs();
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, FONS_CACHE_MAGIC, sizeof(header.magic));
+    header.version = FONS_CACHE_VERSION;
+    header.key = fons__cacheKey();
+    header.baseKey = fons__baseKey();
+    header.width = params.width;
+    header.height = params.height;
+    header.layers = (int)texData.size();
+    header.pages = (int)pages.size();
+    header.fonts = (int)fonts.size();
+    fons__cacheWrite(out, &header, sizeof(header));
+
+    // Fonts without glyphs in the atlas may not even be loaded, they are
+    // left unidentified.
+    for(i = 0; i < (int)fonts.size(); i++)
+    {
+        hash = 0;
+        for(auto &&g : fonts[i].glyphs)
+        {
+            if(g.page >= 0)
+            {
+                hash = fons__fontHash(i);
+                break;
+            }
+        }
+        fons__cacheWrite(out, &hash, sizeof(hash));
+    }
+    for(auto &&page : pages)
+    {
+        const int fields[] = {
+            page.layer, page.y, page.atlas.width, page.atlas.height,
+            page.pinned, (int)page.atlas.nodes.size()
+        };
+        fons__cacheWrite(out, fields, sizeof(fields));
+        fons__cacheWrite(out, page.atlas.nodes.data(),
+            page.atlas.nodes.size() * sizeof(FONSatlasNode));
+    }
+    for(auto &&font : fonts)
+    {
+        n = 0;
+        for(auto &&g : font.glyphs)
+            n += g.page >= 0;
+        fons__cacheWrite(out, &n, sizeof(n));
+        for(auto &&g : font.glyphs)
+        {
+            if(g.page >= 0)
+                fons__cacheWrite(out, &g, sizeof(g));
+        }
+    }
+    for(i = 0; i < (int)texData.size(); i++)
+    {
+        fons__cacheWrite(out, texData[i].get(),
+            (size_t)params.width * params.height);
+    }
+}
+
+int FONScontext::fonsSaveCache(const std::filesystem::path &path)
+{
+    std::filesystem::path temp = path;
+    std::error_code ec;
+
+    // Write to a temporary file first so that a crash never leaves a
+    // truncated cache behind.
+    temp += ".tmp";
+    {
+        std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+        if(!out)
+            return 0;
+        fons__writeCache(out);
+        if(!out)
+            return 0;
+    }
+    std::filesystem::rename(temp, path, ec);
+    return !ec;
+}
+
+std::string FONScontext::fonsSaveCacheMem()
+{
+    std::ostringstream out(std::ios::binary);
+    fons__writeCache(out);
+    return out.str();
+}
+
+int FONScontext::fonsLoadCache(const std::filesystem::path &path)
+{
+    FONSmappedFile file;
+
+    if(!file.fons__mapFile(path))
+        return 0;
+    return fonsLoadCacheMem(file.data, file.size);
+}
+
+void FONScontext::fons__applyCache(FONScacheData &cache, const int *fontMap)
+{
+    const size_t layerSize = (size_t)params.width * params.height;
+    int i, j;
+
+    pages = std::move(cache.pages);
+    for(auto &&page : pages)
+        page.lastUsed = frame;
+    for(i = 0; i < cache.header.layers; i++)
+    {
+        memcpy(texData[i].get(), cache.pixels + layerSize * i, layerSize);
+        fons__markDirty(i, 0, 0, params.width, params.height);
+    }
+    for(i = 0; i < cache.header.fonts; i++)
+    {
+        if(fontMap[i] < 0)
+            continue;
+        FONSfont *font = &fonts[fontMap[i]];
+        font->glyphs = std::move(cache.glyphs[i]);
+        font->lut.fons__tableClear();
+        for(j = 0; j < (int)font->glyphs.size(); j++)
+        {
+            const FONSglyph &g = font->glyphs[j];
+            font->lut.fons__tableInsert({ (unsigned)g.index, g.size, g.blur }, j);
+        }
+    }
+}
+
+int FONScontext::fonsLoadCacheMem(const unsigned char *data, size_t size)
+{
+    FONScacheData cache;
+    std::vector<int> fontMap;
+    int i;
+
+    // Validate everything before touching the atlas.
+    if(!fons__parseCache(data, size, &cache) ||
+        cache.header.key != fons__cacheKey() ||
+        cache.header.fonts != (int)fonts.size())
+        return 0;
+    const FONScacheHeader &header = cache.header;
+    // Without layers the height is bounded by the budget.
+    if(params.renderAddPage == NULL && (header.layers != 1 ||
+        header.height != fons__clampAtlasHeight(header.width, header.height)))
+        return 0;
+    if(params.renderAddPage != NULL && params.atlasBudget > 0 &&
+        (long long)header.layers * header.width * header.height >
+        params.atlasBudget)
+        return 0;
+    // Fonts owning no glyphs are not compared, so that fallbacks nobody
+    // used are not mapped.
+    for(i = 0; i < header.fonts; i++)
+    {
+        if(!cache.glyphs[i].empty() &&
+            fons__fontHash(i) != cache.fontHashes[i])
+            return 0;
+    }
+
+    // Rebuild the atlas at the cached size, then replace its contents.
+    fons__waitGlyphs();
+    queuedGlyphs.clear();
+    if(!fonsResetAtlas(header.width, header.height))
+        return 0;
+    for(i = 1; i < header.layers; i++)
+    {
+        if(!fons__addPage())
+        {
+            fonsResetAtlas(header.width, header.height);
+            return 0;
+        }
+    }
+    for(i = 0; i < header.fonts; i++)
+        fontMap.push_back(i);
+    fons__applyCache(cache, fontMap.data());
+
+    return 1;
+}
+
+int FONScontext::fonsLoadBase(const unsigned char *data, size_t size)
+{
+    FONScacheData cache;
+    std::vector<int> fontMap;
+    int i, j;
+
+    if(!fons__parseCache(data, size, &cache) ||
+        cache.header.baseKey != fons__baseKey() ||
+        cache.header.layers != 1 || cache.header.pages != 1 ||
+        cache.header.height != cache.pages[0].atlas.height ||
+        cache.header.height != fons__clampAtlasHeight(
+            cache.header.width, cache.header.height))
+        return 0;
+
+    // Find the fonts of the base among ours by their data. Those without
+    // glyphs in it need no counterpart.
+    for(i = 0; i < cache.header.fonts; i++)
+    {
+        if(cache.glyphs[i].empty())
+        {
+            fontMap.push_back(-1);
+            continue;
+        }
+        for(j = 0; j < (int)fonts.size(); j++)
+        {
+            if(fons__fontHash(j) == cache.fontHashes[i])
+                break;
+        }
+        if(j == (int)fonts.size())
+            return 0;
+        fontMap.push_back(j);
+    }
+
+    fons__waitGlyphs();
+    queuedGlyphs.clear();
+    if(!fonsResetAtlas(cache.header.width, cache.header.height))
+        return 0;
+    // The base replaces every page of the first layer.
+    for(i = (int)pages.size() - 1; i >= 0; i--)
+    {
+        if(pages[i].layer == 0)
+            pages.erase(pages.begin() + i);
+    }
+    cache.pages[0].pinned = 1;
+    cache.pages.insert(cache.pages.end(), pages.begin(), pages.end());
+    fons__applyCache(cache, fontMap.data());
+
+    return 1;
+}
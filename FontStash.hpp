@@ -19,22 +19,88 @@
 //
 
 #define FONS_INVALID -1
+#define FONS_UNRESOLVED 0xffffffffu
 #include <stdlib.h>
 #include <stb_truetype.h>
 #include <vector>
 #include <memory>
 #include <string>
+#include <iosfwd>
+#include <unordered_map>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <filesystem>
 #include <Usagi/Math/Matrix.hpp>
 #include <Usagi/Math/Bound.hpp>
-#ifndef FONS_HASH_LUT_SIZE
-#	define FONS_HASH_LUT_SIZE 1024
+// Glyph index pairs below this bound have their kerning cached in a dense
+// table, which covers the Latin range of most fonts.
+#ifndef FONS_KERN_DENSE_SIZE
+#	define FONS_KERN_DENSE_SIZE 256
+#endif
+// Codepoints below this bound have their glyph indices cached per font
+// in blocks of 256, each taking 512 bytes once a codepoint in it is
+// looked up. Must be a multiple of 256, 0 disables the index.
+#ifndef FONS_CMAP_INDEX_SIZE
+#	define FONS_CMAP_INDEX_SIZE 0x10000
+#endif
+// Size of the chunks requested from FONSparams::streamAlloc.
+#ifndef FONS_STREAM_CHUNK_SIZE
+#	define FONS_STREAM_CHUNK_SIZE 65536
+#endif
+// Side of the square atlas tiles used to track which parts of the
+// texture need to be uploaded.
+#ifndef FONS_DIRTY_TILE_SIZE
+#	define FONS_DIRTY_TILE_SIZE 64
+#endif
+// Height of the atlas pages when the atlas has a memory budget. Pages are
+// the unit of eviction.
+#ifndef FONS_ATLAS_PAGE_HEIGHT
+#	define FONS_ATLAS_PAGE_HEIGHT 256
+#endif
+// Pixel height the glyph distance fields are rasterized at in FONS_SDF
+// mode, and how far in pixels the field extends beyond the outline.
+#ifndef FONS_SDF_SIZE
+#	define FONS_SDF_SIZE 48
+#endif
+#ifndef FONS_SDF_PADDING
+#	define FONS_SDF_PADDING 6
+#endif
+// Vertex position units per pixel in FONS_SDF mode. Scaled distance field
+// quads do not fall on whole pixels, see FONSvertex.
+#ifndef FONS_SDF_SUBPIXEL
+#	define FONS_SDF_SUBPIXEL 8
+#endif
+// Initial slot count of the per-font glyph tables, must be a power of two.
+#ifndef FONS_GLYPH_TABLE_INIT_SIZE
+#	define FONS_GLYPH_TABLE_INIT_SIZE 256
+#endif
+// Glyphs measured without being loaded that a font keeps before it
+// drops them and starts over, see FONSfont::metrics.
+#ifndef FONS_MAX_MEASURED_GLYPHS
+#	define FONS_MAX_MEASURED_GLYPHS 8192
 #endif
 
 enum FONSflags
 {
     FONS_ZERO_TOPLEFT = 1,
     FONS_ZERO_BOTTOMLEFT = 2,
+    // Store one signed distance field per glyph and scale it to the
+    // requested size, instead of a bitmap per size. The edge is at 0.5
+    // and blur softens the edge instead. Needs the stb_truetype backend,
+    // init() throws with FreeType.
+    FONS_SDF = 4,
+    // getGlyph() does not rasterize missing glyphs. They are queued and
+    // take up their space without being drawn until fonsPumpGlyphs()
+    // brings them in.
+    FONS_ASYNC = 8,
+    // Every batch passed to the draw callbacks samples a single atlas
+    // layer, the one of its first vertex or instance. For renderers that
+    // bind each layer added through FONSparams::renderAddPage as a
+    // texture of its own instead of using a texture array.
+    FONS_LAYER_BATCHES = 16,
 };
 
 enum FONSalign
@@ -64,29 +130,201 @@ enum FONSerrorCode
     FONS_STATES_UNDERFLOW = 4,
 };
 
+// Interleaved vertex. Positions are in whole pixels, or in
+// 1/FONS_SDF_SUBPIXEL pixels in FONS_SDF mode, see fonsVertexScale().
+// Texture coordinates are normalized to [0, 65535].
+struct FONSvertex
+{
+    short x, y;
+    unsigned short s, t;
+    unsigned int color;
+    // Atlas texture layer, see FONSparams::renderAddPage, and edge
+    // softness in distance field units normalized to [0, 65535], see
+    // FONS_SDF.
+    unsigned short layer, softness;
+};
+
+typedef struct FONSvertex FONSvertex;
+
+// One glyph quad for instanced rendering. The quad corners are expanded
+// by the vertex shader.
+struct FONSglyphInstance
+{
+    float x0, y0, x1, y1;
+    float s0, t0, s1, t1;
+    unsigned int color;
+    // Same as in FONSvertex.
+    unsigned short layer, softness;
+};
+
+typedef struct FONSglyphInstance FONSglyphInstance;
+
+// Glyph instance with its shadow composited under it in the same pass,
+// see FONSparams::renderDrawShadowed.
+struct FONSshadowedGlyphInstance
+{
+    // The quad is grown to make room for the shadow.
+    float x0, y0, x1, y1;
+    float s0, t0, s1, t1;
+    unsigned int color;
+    unsigned short layer, softness;
+    // Texture rect of the glyph that samples are clamped to.
+    float u0, v0, u1, v1;
+    // Shadow offset in texture coordinates, edge softness in distance
+    // field units, horizontal distance from a bitmap glyph to its blurred
+    // copy in texture coordinates, 0 with distance fields, and color.
+    float shadowS, shadowT, shadowSoftness, shadowChannel;
+    unsigned int shadowColor;
+};
+
+typedef struct FONSshadowedGlyphInstance FONSshadowedGlyphInstance;
+
 struct FONSparams
 {
     int width, height;
     unsigned char flags;
+    // Maximum size of the atlas texture in bytes, 0 for unbounded growth.
+    // With a budget the atlas is split into pages of FONS_ATLAS_PAGE_HEIGHT
+    // rows, or limited in layers when renderAddPage is set, and the least
+    // recently used page is evicted when full.
+    int atlasBudget;
+    // Frames the GPU may still be sampling the atlas for, counting the one
+    // being recorded. Pages used within them are not evicted, glyphs that
+    // find no other room wait until they can be. 0 if the atlas is only
+    // read while drawing, so that any page can be evicted at once.
+    int framesInFlight;
+    // Number of worker threads rasterizing glyphs missing from the cache
+    // in parallel, 0 to rasterize them on the calling thread. Ignored
+    // with FreeType, whose faces cannot be shared between threads.
+    int threads;
+    // Milliseconds fonsPumpGlyphs() may spend rasterizing queued glyphs on
+    // the calling thread in FONS_ASYNC mode without worker threads. At
+    // least one glyph is rasterized per call.
+    float rasterBudget;
     void *userPtr;
     int (*renderCreate)(void *uptr, int width, int height);
     int (*renderResize)(void *uptr, int width, int height);
     void (*renderUpdate)(void *uptr, int *rect, const unsigned char *data);
+    // Optional. When set, texture changes are flushed through this as
+    // disjoint rects (x0, y0, x1, y1 each) covering only the modified
+    // tiles, instead of one bounding rect through renderUpdate. data is
+    // the whole layer with a stride of its width.
+    void (*renderUpdateRects)(
+        void *uptr,
+        int layer,
+        const int *rects,
+        int nrects,
+        const unsigned char *data);
+    // Optional. When set, the atlas is a texture array of width x height
+    // layers, or one texture per layer with FONS_LAYER_BATCHES, and runs
+    // out of space by asking for one more layer through this, instead of
+    // resizing and re-uploading the whole texture. Returns 0 if the layer
+    // cannot be added. Requires renderUpdateRects.
+    int (*renderAddPage)(void *uptr, int layer);
     void (*renderDraw)(
         void *uptr,
-        const float *verts,
-        const float *tcoords,
-        const unsigned int *colors,
+        const FONSvertex *verts,
         int nverts);
+    // Optional. When set, quads are emitted as one instance per glyph and
+    // flushed through this instead of renderDraw.
+    void (*renderDrawInstanced)(
+        void *uptr,
+        const FONSglyphInstance *instances,
+        int ninstances);
+    // Optional. When set, text with a shadow is emitted as shadowed
+    // instances and flushed through this, otherwise the shadow is drawn
+    // as a blurred copy of the text beforehand. Distance fields are
+    // sampled again for the shadow, bitmap glyphs are rasterized with a
+    // blurred copy of themselves next to them.
+    void (*renderDrawShadowed)(
+        void *uptr,
+        const FONSshadowedGlyphInstance *instances,
+        int ninstances);
     void (*renderDelete)(void *uptr);
+    // Optional allocator for the vertex and instance streams, typically a
+    // FONSring over a persistently mapped buffer. streamAlloc returns size
+    // bytes aligned to a multiple of align, or NULL when out of space in
+    // which case the context falls back to its own memory. streamCommit
+    // hands an allocation back after it was drawn, with the number of
+    // bytes actually written.
+    void *streamUptr;
+    void *(*streamAlloc)(void *uptr, int size, int align);
+    void (*streamCommit)(void *uptr, void *ptr, int used);
 };
 
 typedef struct FONSparams FONSparams;
 
+// Ring of stream memory shared by several frames in flight. Meant to sit
+// on a persistently mapped vertex buffer, with fonsRingAlloc() and
+// fonsRingCommit() plugged into FONSparams. It holds no GPU state, so it
+// works the same over plain memory.
+struct FONSring
+{
+    unsigned char *memory = nullptr;
+    int size = 0;
+    // Next byte to hand out, and the number of bytes from the oldest
+    // in-flight frame up to head.
+    int head = 0;
+    int used = 0;
+    // Number of the frame being recorded, and the bytes it consumed so
+    // far.
+    int frame = 0;
+    int frameBytes = 0;
+    // Frames submitted but not known to be finished, oldest first, with
+    // the bytes each consumed.
+    std::deque<std::pair<int, int>> pending;
+    int framesInFlight = 0;
+    // Optional. Returns the number of the newest frame the GPU has
+    // finished, e.g. the value of a fence or timeline semaphore signalled
+    // with frame after submitting it. Without it a frame is assumed done
+    // framesInFlight frames after it was submitted.
+    void *fenceUptr = nullptr;
+    int (*completedFrame)(void *uptr) = nullptr;
+    // Offset and size of the most recent allocation, whose unused part
+    // can still be returned by commit.
+    int lastOffset = -1, lastSize = 0;
+
+    void fonsRingInit(void *memory, int size, int framesInFlight);
+    // Submits the current frame, begins a new one and recycles the memory
+    // of the frames that finished on the GPU.
+    void fonsRingNextFrame();
+    // Returns the byte offset of ptr inside the ring, or -1.
+    int fonsRingOffset(const void *ptr) const;
+
+    void *fons__ringAlloc(int bytes, int align);
+    void fons__ringCommit(void *ptr, int bytes);
+
+    // FONSparams::streamAlloc and streamCommit with a FONSring as uptr.
+    static void *fonsRingAlloc(void *uptr, int size, int align);
+    static void fonsRingCommit(void *uptr, void *ptr, int used);
+};
+
+typedef struct FONSring FONSring;
+
+// Vertices or instances of the batch being built. They live either in
+// memory from FONSparams::streamAlloc or in the context's own storage.
+template <typename T>
+struct FONSstream
+{
+    T *items = nullptr;
+    int count = 0;
+    int capacity = 0;
+    // Whether items came from the stream allocator.
+    bool external = false;
+    std::vector<T> storage;
+
+    T *data() { return items; }
+    int size() const { return count; }
+    bool empty() const { return count == 0; }
+    T *begin() { return items; }
+    T *end() { return items + count; }
+};
+
 struct FONSquad
 {
     float x0, y0, s0, t0;
     float x1, y1, s1, t1;
+    int layer;
 };
 
 typedef struct FONSquad FONSquad;
@@ -106,18 +344,45 @@ struct FONStextIter
 
 typedef struct FONStextIter FONStextIter;
 
+// Glyph in the atlas, owned by the font that renders it.
 struct FONSglyph
 {
-    unsigned int codepoint;
     int index;
-    int next;
     short size, blur;
+    short page;
     short x0, y0, x1, y1;
     short xadv, xoff, yoff;
 };
 
 typedef struct FONSglyph FONSglyph;
 
+struct FONSglyphKey
+{
+    unsigned int index;
+    short size, blur;
+};
+
+typedef struct FONSglyphKey FONSglyphKey;
+
+// Open addressing table mapping (glyph index, size, blur) to indices into
+// FONSfont::glyphs. Keys are kept apart from the glyph payloads so that
+// probing only touches the key and index arrays, never the glyphs. Grows
+// when 3/4 full.
+struct FONSglyphTable
+{
+    std::vector<FONSglyphKey> keys;
+    // Glyph index of each slot, -1 marks an empty slot.
+    std::vector<int> values;
+    int count = 0;
+
+    int fons__tableFind(unsigned int index, short size, short blur) const;
+    void fons__tableInsert(FONSglyphKey key, int value);
+    void fons__tableGrow(int capacity);
+    void fons__tableClear();
+};
+
+typedef struct FONSglyphTable FONSglyphTable;
+
 struct FONSttFontImpl
 {
     stbtt_fontinfo font;
@@ -125,24 +390,126 @@ struct FONSttFontImpl
 
 typedef struct FONSttFontImpl FONSttFontImpl;
 
+// Read-only view of a whole file mapped into memory.
+struct FONSmappedFile
+{
+    const unsigned char *data = nullptr;
+    size_t size = 0;
+
+    FONSmappedFile() = default;
+    FONSmappedFile(const FONSmappedFile &) = delete;
+    FONSmappedFile & operator=(const FONSmappedFile &) = delete;
+    ~FONSmappedFile();
+
+    // Returns 0 if the file cannot be opened or is empty.
+    int fons__mapFile(const std::filesystem::path &path);
+    void fons__unmapFile();
+};
+
+typedef struct FONSmappedFile FONSmappedFile;
+
+// Contents of a font file, shared by the fonts of every context using it.
+struct FONSfontData
+{
+    // Set when the file is mapped, only the pages the rasterizer touches
+    // are read in.
+    FONSmappedFile file;
+    // Set when the font was given in memory.
+    std::string memory;
+    const unsigned char *data = nullptr;
+    size_t size = 0;
+};
+
+typedef struct FONSfontData FONSfontData;
+
 struct FONSfont
 {
     FONSttFontImpl font;
     std::string name;
-    std::string data;
-    int dataSize;
+    // File of fonts added with fonsAddFont(), data is NULL until the font
+    // is first needed.
+    std::filesystem::path path;
+    std::shared_ptr<const FONSfontData> data;
+    int loadFailed = 0;
     float ascender;
     float descender;
     float lineh;
     std::vector<FONSglyph> glyphs;
-    int lut[FONS_HASH_LUT_SIZE];
+    FONSglyphTable lut;
+    // Glyphs measured without being loaded into the atlas. Only the box
+    // and advance are set and page is -1. They take no atlas space. The
+    // cache is cleared when it reaches FONS_MAX_MEASURED_GLYPHS and by
+    // fonsResetAtlas().
+    std::vector<FONSglyph> metrics;
+    FONSglyphTable metricsLut;
     std::vector<int> fallbacks;
+    // Kerning in font units, independent of the font size. Entries of the
+    // dense table are FONS_KERN_UNKNOWN until queried. Fonts without a
+    // kerning table never allocate them.
+    int hasKerning = 0;
+    std::unique_ptr<short[]> kernDense;
+    std::unordered_map<unsigned int, int> kernSparse;
+    // Glyph indices of the blocks of the cmap index built so far.
+    std::vector<std::unique_ptr<unsigned short[]>> cmapIndex;
+    // Hash identifying the font in atlas caches, 0 until needed.
+    unsigned long long dataHash = 0;
+    // Codepoints resolved through the fallback chain in blocks of 256,
+    // indexed by codepoint >> 8. Entries hold the font index in the upper
+    // and the glyph index in the lower 16 bits, or FONS_UNRESOLVED.
+    std::vector<std::unique_ptr<unsigned int[]>> resolved;
 
     FONSglyph *fons__allocGlyph();
+    int fons__getKern(int glyph1, int glyph2);
+    // Same as fons__getKern() without filling the cache, returns 0 if the
+    // pair is not cached yet.
+    int fons__findKern(int glyph1, int glyph2, int *kern) const;
+    int fons__glyphIndex(unsigned int codepoint);
 };
 
 typedef struct FONSfont FONSfont;
 
+// Glyph on its way into the atlas. Prepared and stored on the owning
+// thread, rasterized into its own bitmap on any thread.
+struct FONSglyphJob
+{
+    // Index into FONScontext::fonts of the font rendering the glyph.
+    int renderFont;
+    short isize, iblur;
+    int index;
+    float scale;
+    short xadv;
+    // Bitmap box relative to the pen position, without padding.
+    int x0, y0, x1, y1;
+    int pad;
+    // Non-zero if the bitmap was copied from a cached glyph.
+    int copied;
+    // Padded bitmap with the empty border, (x1 - x0 + pad * 2) wide for
+    // each channel side by side, see fons__glyphChannels().
+    std::vector<unsigned char> bitmap;
+};
+
+typedef struct FONSglyphJob FONSglyphJob;
+
+// Fixed set of threads running queued tasks.
+struct FONSworkers
+{
+    std::vector<std::thread> threads;
+    std::deque<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool quit = false;
+
+    void fons__workersStart(int n);
+    void fons__workersStop();
+    void fons__workersSubmit(std::function<void()> task);
+    // Calls fn for 0 to n - 1 spread over the workers and the calling
+    // thread, returns when all calls have returned.
+    void fons__workersFor(int n, const std::function<void(int)> &fn);
+    ~FONSworkers();
+};
+
+typedef struct FONSworkers FONSworkers;
+
 struct FONSstate
 {
     int font = 0;
@@ -152,10 +519,62 @@ struct FONSstate
     float blur = 0;
     float spacing = 0;
     float line_spacing = 0;
+    // Shadow drawn under the text, disabled while fully transparent.
+    // Offset and blur are in pixels. It is composited in the same pass as
+    // the text with FONSparams::renderDrawShadowed, otherwise drawn as a
+    // blurred copy beforehand.
+    unsigned int shadow_color = 0;
+    float shadow_x = 0, shadow_y = 0;
+    float shadow_blur = 0;
 };
 
 typedef struct FONSstate FONSstate;
 
+// String measured by fonsTextBoundsBatch() with its own state. Strings
+// in a row with equal fonts, sizes and alignments share their setup.
+struct FONSmeasureItem
+{
+    std::u32string_view str;
+    const FONSstate *state;
+};
+
+typedef struct FONSmeasureItem FONSmeasureItem;
+
+// What measuring needs of a state, see fons__measureSetup().
+struct FONSmeasureSetup
+{
+    FONSfont *font;
+    short isize, iblur;
+    float scale;
+    float spacing;
+    int align;
+    // Offset of the baseline for the vertical alignment.
+    float baseline;
+};
+
+typedef struct FONSmeasureSetup FONSmeasureSetup;
+
+// Vertices produced by one drawText() call. Replayed by drawTextCached()
+// as long as the text, state, bound and atlas generation are unchanged.
+struct FONSlayout
+{
+    std::u32string text;
+    FONSstate state;
+    usagi::AlignedBox2f bound;
+    float transition_begin = 0, transition_end = 0;
+    // Atlas generation the texture coordinates were computed for, -1 if
+    // the layout was never recorded.
+    int generation = -1;
+    float advance = 0;
+    std::vector<FONSvertex> verts;
+    std::vector<FONSglyphInstance> instances;
+    std::vector<FONSshadowedGlyphInstance> shadowedInstances;
+    // Atlas pages sampled by the layout.
+    std::vector<short> pages;
+};
+
+typedef struct FONSlayout FONSlayout;
+
 struct FONSatlasNode
 {
     short x, y, width;
@@ -183,20 +602,104 @@ struct FONSatlas
 
 typedef struct FONSatlas FONSatlas;
 
+// Horizontal band of the atlas texture with its own skyline.
+struct FONSatlasPage
+{
+    // Skyline in page coordinates.
+    FONSatlas atlas;
+    // Texture layer and first row of the page.
+    int layer;
+    int y;
+    // Frame the page was last sampled in, INT_MIN if it never was.
+    int lastUsed;
+    // Non-zero if the page is never evicted, see fonsLoadBase().
+    int pinned = 0;
+};
+
+typedef struct FONSatlasPage FONSatlasPage;
+
+struct FONScacheData;
+
 struct FONScontext
 {
     FONSparams params;
     float itw = 0 , ith = 0;
-    std::unique_ptr<unsigned char[]> texData;
+    // Optional, see fonsSetErrorCallback().
+    void (*handleError)(void *uptr, int error, int val) = nullptr;
+    void *errorUptr = nullptr;
+    // Pixels of each texture layer. There is only one layer unless
+    // params.renderAddPage is set.
+    std::vector<std::unique_ptr<unsigned char[]>> texData;
     int dirtyRect[4] = { 0 };
+    // One entry per FONS_DIRTY_TILE_SIZE square of the atlas, non-zero
+    // if the tile was modified since the last upload.
+    std::vector<unsigned char> dirtyTiles;
+    int dirtyTilesX = 0, dirtyTilesY = 0;
+    std::vector<int> dirtyRects;
+    // Bytes of atlas data passed to renderUpdate or renderUpdateRects in
+    // total, in the frame being recorded and in the last complete frame.
+    // fonsNextFrame() moves on to the next frame.
+    long long uploadedBytes = 0;
+    long long frameUploadedBytes = 0;
+    long long lastFrameUploadedBytes = 0;
+    // Bumped whenever glyph positions in the atlas are invalidated.
+    int atlasGeneration = 0;
     std::vector<FONSfont> fonts;
-    FONSatlas atlas;
-    std::vector<float> verts;
-    std::vector<float> tcoords;
-    std::vector<unsigned int> colors;
+    // A single page covering the whole texture unless params.atlasBudget
+    // is set.
+    std::vector<FONSatlasPage> pages;
+    // Current frame number for page eviction, see fonsNextFrame().
+    int frame = 0;
+    // When set, pages of the glyphs looked up are appended to it.
+    std::vector<short> *pageLog = nullptr;
+    FONSstream<FONSvertex> verts;
+    FONSstream<FONSglyphInstance> instances;
+    FONSstream<FONSshadowedGlyphInstance> shadowedInstances;
+    // Layer of the quads being batched, see FONS_LAYER_BATCHES.
+    int batchLayer = 0;
+    // When set, everything streamed is also appended to it, so that the
+    // layout is recorded whole even if the streams are flushed meanwhile.
+    FONSlayout *layoutLog = nullptr;
+    // Glyph bitmaps being blurred.
+    std::vector<unsigned char> blurScratch;
+    // Glyph missed by getGlyph() and the misses of a batch.
+    FONSglyphJob glyphJob;
+    std::vector<FONSglyphJob> glyphJobs;
+    // Setup of each string of a measuring batch and whether it has to be
+    // measured again on the owning thread.
+    std::vector<FONSmeasureSetup> measureSetups;
+    std::vector<char> measureMissed;
+    FONSworkers workers;
+    // Glyphs queued in FONS_ASYNC mode. Without workers they wait in
+    // queuedGlyphs, otherwise they are rasterized right away and handed
+    // back through readyGlyphs. glyphsInFlight counts the ones given to
+    // the workers and not stored yet.
+    std::deque<FONSglyphJob> queuedGlyphs;
+    std::vector<FONSglyphJob> readyGlyphs;
+    int glyphsInFlight = 0;
+    // Rasterized glyphs that found no page which was safe to evict. They
+    // have placeholders and are stored again by fonsNextFrame().
+    std::vector<FONSglyphJob> blockedGlyphs;
+    std::mutex readyMutex;
+    std::condition_variable glyphReady;
     std::vector<FONSstate> states;
 
     void fons__addWhiteRect(int w, int h);
+    void fons__markDirty(int layer, int x0, int y0, int x1, int y1);
+    void fons__resetDirty();
+    // Coalesces the dirty tiles of a layer into dirtyRects, returns the
+    // rect count.
+    int fons__collectDirtyRects(int layer);
+    template <typename T>
+    T *fons__streamPush(FONSstream<T> &stream, int n);
+    template <typename T>
+    void fons__streamReset(FONSstream<T> &stream);
+    // Appends recorded vertices or instances, in batches of one layer
+    // with FONS_LAYER_BATCHES.
+    template <typename T>
+    void fons__streamReplay(
+        FONSstream<T> &stream,
+        const std::vector<T> &items);
     FONSstate *getState();
 
     void vertex(
@@ -204,7 +707,29 @@ struct FONScontext
         float y,
         float s,
         float t,
-        unsigned int c);
+        unsigned int c,
+        int layer,
+        float softness = 0);
+    // Emits six vertices or one instance depending on whether
+    // params.renderDrawInstanced is set.
+    void quad(const FONSquad &q, unsigned int c, float softness = 0);
+    // Emits an instance grown to fit the shadow of the current state. k is
+    // the ratio of the quad to the distance field size, channel the
+    // distance to the blurred copy of a bitmap glyph.
+    void shadowedQuad(
+        const FONSquad &q,
+        unsigned int c,
+        unsigned int shadowColor,
+        float k,
+        float channel);
+    // Non-zero if text in the state is drawn through shadowedQuad().
+    int fons__singlePassShadow(const FONSstate *state);
+    // Shadowed instances and the other quads are flushed apart. Flushes
+    // the other kind before adding quads of one, so that text is drawn
+    // in order.
+    void fons__beginQuads(int shadowed);
+    // Flushes before quads of another layer with FONS_LAYER_BATCHES.
+    void fons__beginLayer(int layer);
     float getVerticalAlign(FONSfont *font, int align, short isize);
 
     FONSglyph *getGlyph(
@@ -212,6 +737,33 @@ struct FONScontext
         unsigned int codepoint,
         short isize,
         short iblur);
+    // Returns the glyph if it is in the atlas, its metrics otherwise.
+    // Never rasterizes.
+    FONSglyph *fons__measureGlyph(
+        FONSfont *font,
+        unsigned int codepoint,
+        short isize,
+        short iblur);
+    // Same as fons__measureGlyph() without filling any cache, returns
+    // NULL if the glyph was not measured before.
+    FONSglyph *fons__findMeasuredGlyph(
+        FONSfont *font,
+        unsigned int codepoint,
+        short isize,
+        short iblur);
+    // Checks the font of the state and loads it.
+    void fons__measureSetup(const FONSstate *state, FONSmeasureSetup *setup);
+    // Lays str out for its bounds. With shared set only cached glyphs and
+    // kerning are used, so that several threads may measure at once, and
+    // 0 is returned as soon as anything is missing.
+    int fons__measureText(
+        const FONSmeasureSetup *setup,
+        float x,
+        float y,
+        std::u32string_view str,
+        float *bounds,
+        float *advance,
+        int shared);
 
     void fons__blur(
         unsigned char *dst,
@@ -220,35 +772,143 @@ struct FONScontext
         int dstStride,
         int blur);
 
+    // Finds the font of the chain starting at font that has the codepoint
+    // and its glyph index there. Yields font itself and glyph 0 if none
+    // has it. Each codepoint searches the cmaps only once.
+    void fons__resolveGlyph(
+        FONSfont *font,
+        unsigned int codepoint,
+        FONSfont **renderFont,
+        int *glyph);
+    // Maps the requested size and blur to those of the glyph that gets
+    // cached, returns its padding.
+    int fons__glyphVariant(short *isize, short *iblur, float *size);
+    // Looks a glyph up in the font rendering it, returns it if cached or
+    // NULL with job set up for fons__rasterizeGlyph().
+    FONSglyph * fons__prepareGlyph(
+        FONSfont *font,
+        unsigned int codepoint,
+        short isize,
+        short iblur,
+        FONSglyphJob *job);
+    // Renders and blurs the bitmap of a prepared glyph. Safe to call from
+    // any thread, scratch is used for blurring.
+    void fons__rasterizeGlyph(
+        FONSglyphJob *job,
+        std::vector<unsigned char> &scratch);
+    // Packs a rasterized glyph into the atlas.
+    FONSglyph *fons__storeGlyph(FONSglyphJob *job);
+    void fons__copyGlyphBitmap(FONSglyph *glyph, FONSglyphJob *job);
+    // Adds a glyph for a prepared job that takes up its space but has no
+    // page to be drawn from.
+    FONSglyph *fons__addPlaceholder(FONSglyphJob *job);
+    // Adds a placeholder for a prepared glyph and queues it.
+    FONSglyph *fons__queueGlyph(FONSglyphJob *job);
+    // Waits for the workers to finish the glyphs given to them.
+    void fons__waitGlyphs();
+    // Rasterizes glyphJobs on the workers and stores them in order.
+    void fons__loadGlyphs();
+    // Loads the glyphs of str missing from the cache as one batch.
+    void fons__prefetchGlyphs(
+        FONSfont *font,
+        std::u32string_view str,
+        short isize,
+        short iblur);
+
     void fons__getQuad(
         FONSfont *font,
         int prevGlyphIndex,
         FONSglyph *glyph,
+        short isize,
         float scale,
         float spacing,
         float *x,
         float *y,
         FONSquad *q);
 
-    void fons__allocAtlas(int w, int h);
+    void fons__buildPages(int w, int h);
+    int fons__maxAtlasHeight(int w);
+    // Limits an atlas height to the budget, in whole pages.
+    int fons__clampAtlasHeight(int w, int h);
+    // Non-zero if a rect of that size fits into the atlas, merging pages
+    // if need be.
+    int fons__rectFitsPage(int w, int h);
+    // Returns 1 if the rect was placed, 0 if it has to wait for pages to
+    // leave framesInFlight and -1 if it can never be placed.
+    int fons__allocRect(int w, int h, int *x, int *y, int *page);
+    // Turns the least recently used run of adjacent pages at least h rows
+    // tall into one page, for glyphs taller than FONS_ATLAS_PAGE_HEIGHT.
+    // Returns like fons__allocRect().
+    int fons__mergePages(int h, int *page);
+    // Appends a texture layer with one page covering it.
+    int fons__addPage();
+    void fons__evictPage(int page);
+    void fons__touchPage(int page);
 
     void init(FONSparams params);
     ~FONScontext();
 
+    void fonsSetErrorCallback(
+        void (*callback)(void *uptr, int error, int val),
+        void *uptr);
     // Returns current atlas size.
     void fonsGetAtlasSize(int *width, int *height);
-    // Expands the atlas size.
+    // Expands the atlas size. Adds a layer instead when the atlas is a
+    // texture array.
     int fonsExpandAtlas(int width, int height);
     // Resets the whole stash.
     int fonsResetAtlas(int width, int height);
+    // Advances the frame counter used to find the least recently used
+    // atlas page, and stores the glyphs that had to wait for pages to
+    // leave FONSparams::framesInFlight.
+    void fonsNextFrame();
+    // Stores the glyphs loaded since the last call in FONS_ASYNC mode,
+    // returns how many are still pending.
+    int fonsPumpGlyphs();
 
     // Add fonts
+    // Registers a font file. It is mapped and parsed on first use, which
+    // for fallbacks is the first codepoint missing from the fonts before
+    // them. A file that cannot be loaded then acts like an empty font.
     int fonsAddFont(std::string name, const std::filesystem::path &path);
     int fonsAddFontMem(
         std::string name,
         std::string data);
+    int fonsAddFontData(
+        std::string name,
+        std::shared_ptr<const FONSfontData> data);
+    // Maps a font file, or returns the mapping of the same file that is
+    // still in use by any context. Returns NULL if the file cannot be
+    // mapped.
+    static std::shared_ptr<const FONSfontData> fonsMapFontData(
+        const std::filesystem::path &path);
+    // Loads a font added by path if it was not yet, returns 0 if that
+    // fails.
+    int fons__loadFont(FONSfont *font);
+    int fons__initFont(
+        FONSfont *font,
+        std::shared_ptr<const FONSfontData> data);
     int fonsGetFontByName(const char *name);
     int addFallbackFont(int base, int fallback);
+    // Bytes taken by the cmap indices of all fonts, see
+    // FONS_CMAP_INDEX_SIZE.
+    size_t fonsCmapIndexMemory() const;
+
+    // Loads every combination of the given sizes, blurs and characters of
+    // a font into the atlas at once, tallest first, so that drawing them
+    // later does not rasterize. Glyphs beyond the atlas budget evict the
+    // earlier ones. Returns the number of glyphs added.
+    int fonsPrewarm(
+        int font,
+        const std::vector<float> &sizes,
+        const std::vector<float> &blurs,
+        std::u32string_view chars);
+    // Same as above for inclusive codepoint ranges, clamped to U+10FFFF.
+    int fonsPrewarm(
+        int font,
+        const std::vector<float> &sizes,
+        const std::vector<float> &blurs,
+        const std::vector<std::pair<char32_t, char32_t>> &ranges);
 
     // State handling
     void pushState();
@@ -263,19 +923,65 @@ struct FONScontext
         float transition_begin,
         float transition_end
     );
+    // Same as drawText() but replays the vertices recorded in layout if
+    // nothing affecting them has changed since the last call.
+    float drawTextCached(
+        FONSlayout &layout,
+        std::u32string_view str,
+        const usagi::AlignedBox2f &bound,
+        float transition_begin,
+        float transition_end
+    );
 
-    // Measure text
+    // Measure text. Only glyph metrics are looked up, so measuring does
+    // not load glyphs into the atlas.
     float fonsTextBounds(
         float x,
         float y,
         std::u32string_view str,
         float *bounds);
+    // Measures many strings at the origin, each with its own state. bounds
+    // receives four floats per string as from fonsTextBounds() and
+    // advances one, either may be NULL. Strings whose glyphs were measured
+    // before are spread over the worker threads.
+    void fonsTextBoundsBatch(
+        const FONSmeasureItem *items,
+        int count,
+        float *bounds,
+        float *advances);
     void fonsLineBounds(float y, float *miny, float *maxy);
     void fonsVertMetrics(float *ascender, float *descender, float *lineh);
 
     // Pull texture changes
     const unsigned char * fonsGetTextureData(int *width, int *height);
     int fonsValidateTexture(int *dirty);
+    // Pixels per unit of FONSvertex positions.
+    float fonsVertexScale() const;
+
+    // Save and restore the atlas with all glyphs in it, so that they do
+    // not have to be rasterized again on the next start. A cache only
+    // loads into a context with the same number of fonts, the ones with
+    // glyphs in it added at the same place, and the same atlas
+    // configuration. fonsLoadCache() returns 0 without
+    // changing anything if the file is missing, stale or damaged.
+    int fonsSaveCache(const std::filesystem::path &path);
+    int fonsLoadCache(const std::filesystem::path &path);
+    std::string fonsSaveCacheMem();
+    int fonsLoadCacheMem(const unsigned char *data, size_t size);
+    // Loads a single layer cache, typically baked ahead of time by
+    // FontAtlasAssetConverter, as a pinned page of layer 0. Its glyphs
+    // stay for good, new glyphs go to the space left in it and to the
+    // other pages. Unlike fonsLoadCacheMem() the fonts with glyphs in
+    // it only need to be present, in any order, and the atlas
+    // configuration may differ.
+    // Returns 0 if the cache does not match. fonsResetAtlas() drops the
+    // base.
+    int fonsLoadBase(const unsigned char *data, size_t size);
+    unsigned long long fons__fontHash(int font);
+    unsigned long long fons__baseKey();
+    unsigned long long fons__cacheKey();
+    void fons__writeCache(std::ostream &out);
+    void fons__applyCache(FONScacheData &cache, const int *fontMap);
 
     // Draws the stash texture for debugging
     void fonsDrawDebug(float x, float y);
@@ -15,12 +15,20 @@ struct FontStashComponent : Component
     float blur = 0;
     float spacing = 0;
     float line_spacing = 5;
+    // fields up to here mirror FONSstate
+    unsigned int shadow_color = 0xFF000000;
+    float shadow_x = 0, shadow_y = 0;
+    // negative for an eighth of the unscaled text size
+    float shadow_blur = -1;
 
     float transition_begin = 0;
     float transition_end = 0;
 
     std::u32string uft32_text;
 
+    // Layout cache maintained by FontStashSystem.
+    FONSlayout text_layout;
+
     const std::type_info & baseType() override
     {
         return typeid(FontStashComponent);
@@ -1,5 +1,7 @@
 ﻿#include "FontStashSystem.hpp"
 
+#include <algorithm>
+
 #include <Usagi/Runtime/Graphics/GpuImageCreateInfo.hpp>
 #include <Usagi/Game/Game.hpp>
 #include <Usagi/Runtime/Runtime.hpp>
@@ -20,8 +22,27 @@
 #include <Usagi/Runtime/Graphics/GraphicsPipelineCompiler.hpp>
 #include <Usagi/Asset/AssetRoot.hpp>
 
+#include "FontAtlasAssetConverter.hpp"
+
 namespace usagi
 {
+namespace
+{
+// frames that may be in flight while a new one is being recorded. the
+// stream ring follows the command lists instead, this only keeps atlas
+// pages sampled by them from being evicted.
+constexpr int FRAMES_IN_FLIGHT = 3;
+constexpr int STREAM_RING_SIZE = 4 * 1024 * 1024;
+// atlas layers are square textures, up to two of them before layers start
+// being evicted. baked atlases have to be of the same size.
+constexpr int ATLAS_SIZE = 2048;
+constexpr int ATLAS_BUDGET = ATLAS_SIZE * ATLAS_SIZE * 2;
+// threads rasterizing glyph misses, leaving one core to the game
+constexpr int RASTER_THREADS_MAX = 4;
+// milliseconds per frame spent on new glyphs when there are no threads
+constexpr float RASTER_BUDGET_MS = 2.f;
+}
+
 int FontStashSystem::dispatchRenderCreate(void *user_ptr, int width, int height)
 {
     return static_cast<FontStashSystem*>(user_ptr)->renderCreate(width, height);
@@ -32,23 +53,50 @@ int FontStashSystem::dispatchRenderResize(void *user_ptr, int width, int height)
     return static_cast<FontStashSystem*>(user_ptr)->renderResize(width, height);
 }
 
-void FontStashSystem::dispatchRenderUpdate(
+int FontStashSystem::dispatchRenderAddPage(void *user_ptr, int layer)
+{
+    return static_cast<FontStashSystem*>(user_ptr)->renderAddPage(layer);
+}
+
+void FontStashSystem::dispatchRenderUpdateRects(
     void *user_ptr,
-    int *rect,
+    int layer,
+    const int *rects,
+    int num_rects,
     const unsigned char *data)
 {
-    static_cast<FontStashSystem*>(user_ptr)->renderUpdate(rect, data);
+    static_cast<FontStashSystem*>(user_ptr)->renderUpdateRects(
+        layer, rects, num_rects, data
+    );
 }
 
 void FontStashSystem::dispatchRenderDraw(
     void *user_ptr,
-    const float *vertices,
-    const float *tex_coords,
-    const unsigned *colors,
+    const FONSvertex *vertices,
     int num_vertices)
 {
     static_cast<FontStashSystem*>(user_ptr)->renderDraw(
-        vertices, tex_coords, colors, num_vertices
+        vertices, num_vertices
+    );
+}
+
+void FontStashSystem::dispatchRenderDrawInstanced(
+    void *user_ptr,
+    const FONSglyphInstance *instances,
+    int num_instances)
+{
+    static_cast<FontStashSystem*>(user_ptr)->renderDrawInstanced(
+        instances, num_instances
+    );
+}
+
+void FontStashSystem::dispatchRenderDrawShadowed(
+    void *user_ptr,
+    const FONSshadowedGlyphInstance *instances,
+    int num_instances)
+{
+    static_cast<FontStashSystem*>(user_ptr)->renderDrawShadowed(
+        instances, num_instances
     );
 }
 
@@ -57,7 +105,12 @@ void FontStashSystem::dispatchRenderDelete(void *user_ptr)
     static_cast<FontStashSystem*>(user_ptr)->renderDelete();
 }
 
-int FontStashSystem::renderCreate(int width, int height)
+int FontStashSystem::dispatchCompletedFrame(void *user_ptr)
+{
+    return static_cast<FontStashSystem*>(user_ptr)->completedFrame();
+}
+
+void FontStashSystem::addLayerTexture(int width, int height)
 {
     auto gpu = mGame->runtime()->gpu();
     {
@@ -65,7 +118,7 @@ int FontStashSystem::renderCreate(int width, int height)
         info.format = GpuBufferFormat::R8_UNORM;
         info.size = { width, height };
         info.usage = GpuImageUsage::SAMPLED;
-        mFontTexture = gpu->createImage(info);
+        mFontTextures.push_back(gpu->createImage(info));
     }
     {
         GpuImageViewCreateInfo info;
@@ -73,12 +126,22 @@ int FontStashSystem::renderCreate(int width, int height)
         info.components.g = GpuImageComponentSwizzle::ONE;
         info.components.b = GpuImageComponentSwizzle::ONE;
         info.components.a = GpuImageComponentSwizzle::R;
-        mFontTextureView = mFontTexture->createView(info);
+        mFontTextureViews.push_back(mFontTextures.back()->createView(info));
     }
+}
+
+int FontStashSystem::renderCreate(int width, int height)
+{
+    auto gpu = mGame->runtime()->gpu();
+    // the atlas starts over with a single layer
+    mFontTextureViews.clear();
+    mFontTextures.clear();
+    addLayerTexture(width, height);
     {
         GpuSamplerCreateInfo info;
         info.min_filter = GpuFilter::LINEAR;
-        info.mag_filter = GpuFilter::NEAREST;
+        // distance fields are magnified when drawn above FONS_SDF_SIZE
+        info.mag_filter = mSdf ? GpuFilter::LINEAR : GpuFilter::NEAREST;
         info.addressing_mode_u = GpuSamplerAddressMode::REPEAT;
         info.addressing_mode_v = GpuSamplerAddressMode::REPEAT;
         mFontSampler = gpu->createSampler(info);
@@ -91,78 +154,197 @@ int FontStashSystem::renderResize(int width, int height)
     return renderCreate(width, height);
 }
 
-void FontStashSystem::renderUpdate(int *rect, const unsigned char *data)
+int FontStashSystem::renderAddPage(int layer)
 {
-    // todo only update subregion
-    // const Vector2i offset { rect[0], rect[1] };
-    // const Vector2u32 size { rect[2] - rect[0], rect[3] - rect[1] };
-    // mFontTexture->uploadRegion(
-    //     data, size.x() * size.y() offset, size
-    // )
-    const auto size = mFontTexture->size();
-    mFontTexture->upload(data, size.x() * size.y());
+    const auto size = mFontTextures.front()->size();
+    if(layer != (int)mFontTextures.size())
+        return 0;
+    addLayerTexture(size.x(), size.y());
+    return 1;
+}
+
+void FontStashSystem::renderUpdateRects(
+    int layer,
+    const int *rects,
+    int num_rects,
+    const unsigned char *data)
+{
+    const auto &texture = mFontTextures[layer];
+    const auto stride = texture->size().x();
+    for(auto i = 0; i < num_rects; ++i)
+    {
+        const int *rect = rects + i * 4;
+        const Vector2i offset { rect[0], rect[1] };
+        const Vector2u32 size { rect[2] - rect[0], rect[3] - rect[1] };
+
+        // the atlas rows are strided, pack the region before uploading
+        mUploadScratch.resize(size.x() * size.y());
+        for(std::uint32_t y = 0; y < size.y(); ++y)
+        {
+            memcpy(&mUploadScratch[y * size.x()],
+                data + (rect[1] + y) * stride + rect[0], size.x());
+        }
+        texture->uploadRegion(
+            mUploadScratch.data(), mUploadScratch.size(), offset, size
+        );
+    }
 }
 
 void FontStashSystem::renderDraw(
-    const float *vertices,
-    const float *tex_coords,
-    const unsigned *colors,
+    const FONSvertex *vertices,
     int num_vertices)
 {
-    mPosBuffer->allocate(num_vertices * sizeof(Vector2f));
-    mTexCoordsBuffer->allocate(num_vertices * sizeof(Vector2f));
-    mColorBuffer->allocate(num_vertices * sizeof(std::uint32_t));
+    bindLayer(vertices[0].layer);
 
-    memcpy(mPosBuffer->mappedMemory(),
-        vertices, num_vertices * sizeof(Vector2f));
-    memcpy(mTexCoordsBuffer->mappedMemory(),
-        tex_coords, num_vertices * sizeof(Vector2f));
-    memcpy(mColorBuffer->mappedMemory(),
-        colors, num_vertices * sizeof(std::uint32_t));
+    const auto offset = mStreamRing.fonsRingOffset(vertices);
+    if(offset >= 0)
+    {
+        mCurrentCmdList->bindVertexBuffer(0, mStreamBuffer);
+        mCurrentCmdList->drawInstanced(num_vertices, 1,
+            offset / sizeof(FONSvertex), 0);
+        return;
+    }
 
-    mPosBuffer->flush();
-    mTexCoordsBuffer->flush();
-    mColorBuffer->flush();
+    const auto size = num_vertices * sizeof(FONSvertex);
+    mVertexBuffer->allocate(size);
+    memcpy(mVertexBuffer->mappedMemory(), vertices, size);
+    mVertexBuffer->flush();
 
-    mCurrentCmdList->bindVertexBuffer(0, mPosBuffer);
-    mCurrentCmdList->bindVertexBuffer(1, mTexCoordsBuffer);
-    mCurrentCmdList->bindVertexBuffer(2, mColorBuffer);
+    mCurrentCmdList->bindVertexBuffer(0, mVertexBuffer);
 
     mCurrentCmdList->drawInstanced(num_vertices, 1, 0, 0);
 
-    mPosBuffer->release();
-    mTexCoordsBuffer->release();
-    mColorBuffer->release();
+    mVertexBuffer->release();
+}
+
+void FontStashSystem::renderDrawInstanced(
+    const FONSglyphInstance *instances,
+    int num_instances)
+{
+    bindLayer(instances[0].layer);
+
+    const auto offset = mStreamRing.fonsRingOffset(instances);
+    if(offset >= 0)
+    {
+        mCurrentCmdList->bindVertexBuffer(0, mStreamBuffer);
+        mCurrentCmdList->drawInstanced(6, num_instances,
+            0, offset / sizeof(FONSglyphInstance));
+        return;
+    }
+
+    const auto size = num_instances * sizeof(FONSglyphInstance);
+    mInstanceBuffer->allocate(size);
+    memcpy(mInstanceBuffer->mappedMemory(), instances, size);
+    mInstanceBuffer->flush();
+
+    mCurrentCmdList->bindVertexBuffer(0, mInstanceBuffer);
+
+    // the vertex shader expands each instance into two triangles
+    mCurrentCmdList->drawInstanced(6, num_instances, 0, 0);
+
+    mInstanceBuffer->release();
+}
+
+void FontStashSystem::renderDrawShadowed(
+    const FONSshadowedGlyphInstance *instances,
+    int num_instances)
+{
+    bindPipeline(mShadowedPipeline);
+    bindLayer(instances[0].layer);
+
+    const auto offset = mStreamRing.fonsRingOffset(instances);
+    if(offset >= 0)
+    {
+        mCurrentCmdList->bindVertexBuffer(0, mStreamBuffer);
+        mCurrentCmdList->drawInstanced(6, num_instances,
+            0, offset / sizeof(FONSshadowedGlyphInstance));
+    }
+    else
+    {
+        const auto size = num_instances * sizeof(FONSshadowedGlyphInstance);
+        mInstanceBuffer->allocate(size);
+        memcpy(mInstanceBuffer->mappedMemory(), instances, size);
+        mInstanceBuffer->flush();
+
+        mCurrentCmdList->bindVertexBuffer(0, mInstanceBuffer);
+        mCurrentCmdList->drawInstanced(6, num_instances, 0, 0);
+
+        mInstanceBuffer->release();
+    }
+
+    bindPipeline(mPipeline);
 }
 
 void FontStashSystem::renderDelete()
 {
-    mFontTextureView.reset();
-    mFontTexture.reset();
+    mFontTextureViews.clear();
+    mFontTextures.clear();
     mFontSampler.reset();
 }
 
-FontStashSystem::FontStashSystem(Game *game)
-    : mGame(game)
+int FontStashSystem::completedFrame()
 {
-    FONSparams params;
+    // frames finish in submission order
+    while(!mPendingFrames.empty() && mPendingFrames.front().second.expired())
+    {
+        mCompletedFrame = mPendingFrames.front().first;
+        mPendingFrames.pop_front();
+    }
+    return mCompletedFrame;
+}
 
-    params.width = 2048;
-    params.height = 2048;
-    params.flags = FONS_ZERO_TOPLEFT;
+FontStashSystem::FontStashSystem(
+    Game *game,
+    bool instanced,
+    bool sdf,
+    bool async)
+    : mGame(game)
+    , mInstanced(instanced)
+    , mSdf(sdf)
+{
+    FONSparams params { };
+
+    params.width = ATLAS_SIZE;
+    params.height = ATLAS_SIZE;
+    params.flags = FONS_ZERO_TOPLEFT | FONS_LAYER_BATCHES |
+        (async ? FONS_ASYNC : 0) | (mSdf ? FONS_SDF : 0);
+    params.atlasBudget = ATLAS_BUDGET;
+    params.framesInFlight = FRAMES_IN_FLIGHT;
+    params.threads = std::clamp(
+        (int)std::thread::hardware_concurrency() - 1, 0, RASTER_THREADS_MAX);
+    params.rasterBudget = RASTER_BUDGET_MS;
     params.renderCreate = dispatchRenderCreate;
     params.renderResize = dispatchRenderResize;
-    params.renderUpdate = dispatchRenderUpdate;
+    params.renderUpdateRects = dispatchRenderUpdateRects;
+    params.renderAddPage = dispatchRenderAddPage;
     params.renderDraw = dispatchRenderDraw;
+    params.renderDrawInstanced =
+        mInstanced ? dispatchRenderDrawInstanced : nullptr;
+    params.renderDrawShadowed =
+        mInstanced ? dispatchRenderDrawShadowed : nullptr;
     params.renderDelete = dispatchRenderDelete;
     params.userPtr = this;
 
+    auto gpu = mGame->runtime()->gpu();
+    mStreamBuffer = gpu->createBuffer(GpuBufferUsage::VERTEX);
+    mStreamBuffer->allocate(STREAM_RING_SIZE);
+    // without a persistent mapping every batch goes through the fallback
+    // buffers. memory of a frame is reused once its command list is done.
+    if(mStreamBuffer->mappedMemory() != nullptr)
+    {
+        mStreamRing.fonsRingInit(mStreamBuffer->mappedMemory(),
+            STREAM_RING_SIZE, FRAMES_IN_FLIGHT);
+        mStreamRing.fenceUptr = this;
+        mStreamRing.completedFrame = dispatchCompletedFrame;
+        params.streamUptr = &mStreamRing;
+        params.streamAlloc = FONSring::fonsRingAlloc;
+        params.streamCommit = FONSring::fonsRingCommit;
+    }
+
     mContext.init(params);
 
-    auto gpu = mGame->runtime()->gpu();
-    mPosBuffer = gpu->createBuffer(GpuBufferUsage::VERTEX);
-    mTexCoordsBuffer = gpu->createBuffer(GpuBufferUsage::VERTEX);
-    mColorBuffer = gpu->createBuffer(GpuBufferUsage::VERTEX);
+    mVertexBuffer = gpu->createBuffer(GpuBufferUsage::VERTEX);
+    mInstanceBuffer = gpu->createBuffer(GpuBufferUsage::VERTEX);
     mCommandPool = gpu->createCommandPool();
 }
 
@@ -172,6 +354,7 @@ FontStashSystem::~FontStashSystem()
 
 void FontStashSystem::update(const Clock &clock)
 {
+    mContext.fonsPumpGlyphs();
 }
 
 void FontStashSystem::createRenderTarget(RenderTargetDescriptor &descriptor)
@@ -181,6 +364,15 @@ void FontStashSystem::createRenderTarget(RenderTargetDescriptor &descriptor)
 }
 
 void FontStashSystem::createPipelines()
+{
+    mPipeline = compilePipeline(false);
+    // shadows are composited in the same pass only with instances
+    if(mInstanced)
+        mShadowedPipeline = compilePipeline(true);
+}
+
+std::shared_ptr<GraphicsPipeline> FontStashSystem::compilePipeline(
+    bool shadowed)
 {
     auto gpu = mGame->runtime()->gpu();
     auto assets = mGame->assets();
@@ -190,30 +382,112 @@ void FontStashSystem::createPipelines()
     {
         compiler->setShader(ShaderStage::VERTEX,
             assets->res<SpirvAssetConverter>(
-                "fontstash:shaders/shader.vert", ShaderStage::VERTEX)
+                shadowed
+                    ? "fontstash:shaders/shader_shadowed.vert"
+                    : mInstanced
+                    ? "fontstash:shaders/shader_instanced.vert"
+                    : "fontstash:shaders/shader.vert",
+                ShaderStage::VERTEX)
         );
         compiler->setShader(ShaderStage::FRAGMENT,
             assets->res<SpirvAssetConverter>(
-                "fontstash:shaders/shader.frag", ShaderStage::FRAGMENT)
+                mSdf
+                    ? "fontstash:shaders/shader_sdf.frag"
+                    : shadowed
+                    ? "fontstash:shaders/shader_shadowed.frag"
+                    : "fontstash:shaders/shader.frag",
+                ShaderStage::FRAGMENT)
         );
     }
     // Vertex Inputs
+    if(shadowed)
+    {
+        compiler->setVertexBufferBinding(0,
+            sizeof(FONSshadowedGlyphInstance), VertexInputRate::PER_INSTANCE);
+
+        compiler->setVertexAttribute(
+            "Rect", 0,
+            offsetof(FONSshadowedGlyphInstance, x0),
+            GpuBufferFormat::R32G32B32A32_SFLOAT
+        );
+        compiler->setVertexAttribute(
+            "TexRect", 0,
+            offsetof(FONSshadowedGlyphInstance, s0),
+            GpuBufferFormat::R32G32B32A32_SFLOAT
+        );
+        compiler->setVertexAttribute(
+            "Color", 0,
+            offsetof(FONSshadowedGlyphInstance, color),
+            GpuBufferFormat::R8G8B8A8_UNORM
+        );
+        compiler->setVertexAttribute(
+            "Softness", 0,
+            offsetof(FONSshadowedGlyphInstance, softness),
+            GpuBufferFormat::R16_UNORM
+        );
+        compiler->setVertexAttribute(
+            "TexClamp", 0,
+            offsetof(FONSshadowedGlyphInstance, u0),
+            GpuBufferFormat::R32G32B32A32_SFLOAT
+        );
+        compiler->setVertexAttribute(
+            "Shadow", 0,
+            offsetof(FONSshadowedGlyphInstance, shadowS),
+            GpuBufferFormat::R32G32B32A32_SFLOAT
+        );
+        compiler->setVertexAttribute(
+            "ShadowColor", 0,
+            offsetof(FONSshadowedGlyphInstance, shadowColor),
+            GpuBufferFormat::R8G8B8A8_UNORM
+        );
+        compiler->iaSetPrimitiveTopology(PrimitiveTopology::TRIANGLE_LIST);
+    }
+    else if(mInstanced)
     {
-        compiler->setVertexBufferBinding(0, sizeof(float) * 2);
-        compiler->setVertexBufferBinding(1, sizeof(float) * 2);
-        compiler->setVertexBufferBinding(2, sizeof(std::uint32_t));
+        compiler->setVertexBufferBinding(0, sizeof(FONSglyphInstance),
+            VertexInputRate::PER_INSTANCE);
+
+        compiler->setVertexAttribute(
+            "Rect", 0,
+            offsetof(FONSglyphInstance, x0),
+            GpuBufferFormat::R32G32B32A32_SFLOAT
+        );
+        compiler->setVertexAttribute(
+            "TexRect", 0,
+            offsetof(FONSglyphInstance, s0),
+            GpuBufferFormat::R32G32B32A32_SFLOAT
+        );
+        compiler->setVertexAttribute(
+            "Color", 0,
+            offsetof(FONSglyphInstance, color),
+            GpuBufferFormat::R8G8B8A8_UNORM
+        );
+        compiler->setVertexAttribute(
+            "Softness", 0,
+            offsetof(FONSglyphInstance, softness),
+            GpuBufferFormat::R16_UNORM
+        );
+        compiler->iaSetPrimitiveTopology(PrimitiveTopology::TRIANGLE_LIST);
+    }
+    else
+    {
+        compiler->setVertexBufferBinding(0, sizeof(FONSvertex));
 
         compiler->setVertexAttribute(
             "Position", 0,
-            0, GpuBufferFormat::R32G32_SFLOAT
+            offsetof(FONSvertex, x), GpuBufferFormat::R16G16_SINT
+        );
+        compiler->setVertexAttribute(
+            "TexCoord", 0,
+            offsetof(FONSvertex, s), GpuBufferFormat::R16G16_UNORM
         );
         compiler->setVertexAttribute(
-            "TexCoord", 1,
-            0, GpuBufferFormat::R32G32_SFLOAT
+            "Color", 0,
+            offsetof(FONSvertex, color), GpuBufferFormat::R8G8B8A8_UNORM
         );
         compiler->setVertexAttribute(
-            "Color", 2,
-            0, GpuBufferFormat::R8G8B8A8_UNORM
+            "Softness", 0,
+            offsetof(FONSvertex, softness), GpuBufferFormat::R16_UNORM
         );
         compiler->iaSetPrimitiveTopology(PrimitiveTopology::TRIANGLE_LIST);
     }
@@ -235,7 +509,27 @@ void FontStashSystem::createPipelines()
     }
     compiler->setRenderPass(mRenderTarget->renderPass());
 
-    mPipeline = compiler->compile();
+    return compiler->compile();
+}
+
+void FontStashSystem::bindPipeline(
+    const std::shared_ptr<GraphicsPipeline> &pipeline)
+{
+    mCurrentCmdList->bindPipeline(pipeline);
+    mCurrentCmdList->setConstant(ShaderStage::VERTEX,
+        "screenDimensions", mTargetSize);
+    mCurrentCmdList->setConstant(ShaderStage::VERTEX,
+        "scale", Vector2f { 1, 1 });
+    mCurrentCmdList->setConstant(ShaderStage::VERTEX,
+        "translate", Vector2f { 0, 0 });
+    mCurrentCmdList->setConstant(ShaderStage::VERTEX,
+        "positionScale", mContext.fonsVertexScale());
+}
+
+void FontStashSystem::bindLayer(int layer)
+{
+    mCurrentCmdList->bindResourceSet(0,
+        { mFontSampler, mFontTextureViews[layer] });
 }
 
 std::shared_ptr<GraphicsCommandList> FontStashSystem::render(const Clock &clock)
@@ -243,6 +537,9 @@ std::shared_ptr<GraphicsCommandList> FontStashSystem::render(const Clock &clock)
     auto framebuffer = mRenderTarget->createFramebuffer();
     const auto size = framebuffer->size();
     mCurrentCmdList = mCommandPool->allocateGraphicsCommandList();
+    mStreamRing.fonsRingNextFrame();
+    mPendingFrames.emplace_back(mStreamRing.frame, mCurrentCmdList);
+    mContext.fonsNextFrame();
 
     mCurrentCmdList->beginRecording();
     mCurrentCmdList->beginRendering(
@@ -250,22 +547,24 @@ std::shared_ptr<GraphicsCommandList> FontStashSystem::render(const Clock &clock)
         std::move(framebuffer)
     );
 
-    mCurrentCmdList->bindPipeline(mPipeline);
-    mCurrentCmdList->setViewport(0, { 0, 0 }, size.cast<float>());
+    mTargetSize = size.cast<float>();
+    mCurrentCmdList->setViewport(0, { 0, 0 }, mTargetSize);
     mCurrentCmdList->setScissor(0, { 0, 0 }, size);
-    mCurrentCmdList->bindResourceSet(0, { mFontSampler, mFontTextureView });
-    mCurrentCmdList->setConstant(ShaderStage::VERTEX,
-        "screenDimensions", size.cast<float>().eval());
-    mCurrentCmdList->setConstant(ShaderStage::VERTEX,
-        "scale", Vector2f { 1, 1 });
-    mCurrentCmdList->setConstant(ShaderStage::VERTEX,
-        "translate", Vector2f { 0, 0 });
+    bindPipeline(mPipeline);
 
-    // handle resolution changes
+    // handle resolution changes. distance fields are shared by all sizes
+    // so the atlas stays valid.
     const auto scaling = mScalingFunc();
     if(scaling != mLastScaling)
     {
-        mContext.fonsResetAtlas(2048, 2048);
+        if(!mSdf)
+        {
+            mContext.fonsResetAtlas(ATLAS_SIZE, ATLAS_SIZE);
+            if(mBakedAtlas)
+                mContext.fonsLoadBase(
+                    (const unsigned char *)mBakedAtlas->data(),
+                    mBakedAtlas->size());
+        }
         mLastScaling = scaling;
     }
 
@@ -275,28 +574,29 @@ std::shared_ptr<GraphicsCommandList> FontStashSystem::render(const Clock &clock)
         auto pos = std::get<Bound2DComponent *>(e.second);
         auto &state = *mContext.getState();
         state = *reinterpret_cast<FONSstate *>(& text->font);
-        // todo don't hard code text shadow
-        state.blur = state.size / 8;
-        state.color = 0xFF000000;
         state.size *= scaling;
+        state.shadow_x *= scaling;
+        state.shadow_y *= scaling;
+        // negative blurs keep the shadow text had before it could be
+        // configured
+        if(state.shadow_blur < 0)
+            state.shadow_blur = text->size / 8;
+        else
+            state.shadow_blur *= scaling;
         AlignedBox2f scaled_bound {
             pos->bound.min() * scaling,
             pos->bound.max() * scaling
         };
-        mContext.drawText(
-            text->uft32_text,
-            scaled_bound,
-            text->transition_begin, text->transition_end
-        );
-        state.blur = 0;
-        state.color = text->color;
-        mContext.drawText(
+        // the shadow is drawn in the same call
+        mContext.drawTextCached(
+            text->text_layout,
             text->uft32_text,
             scaled_bound,
             text->transition_begin, text->transition_end
         );
     }
     mContext.flush();
+    mStreamBuffer->flush();
 
     mCurrentCmdList->endRendering();
     mCurrentCmdList->endRecording();
@@ -308,4 +608,54 @@ int FontStashSystem::addFont(std::string name, const std::filesystem::path &path
 {
     return mContext.fonsAddFont(std::move(name), path);
 }
+
+namespace
+{
+std::vector<float> scaled(std::vector<float> values, float scaling)
+{
+    for(auto &&v : values)
+        v *= scaling;
+    return values;
+}
+}
+
+int FontStashSystem::prewarm(
+    int font,
+    const std::vector<float> &sizes,
+    const std::vector<float> &blurs,
+    std::u32string_view chars)
+{
+    const auto scaling = mScalingFunc();
+    return mContext.fonsPrewarm(font,
+        scaled(sizes, scaling), scaled(blurs, scaling), chars);
+}
+
+int FontStashSystem::prewarm(
+    int font,
+    const std::vector<float> &sizes,
+    const std::vector<float> &blurs,
+    const std::vector<std::pair<char32_t, char32_t>> &ranges)
+{
+    const auto scaling = mScalingFunc();
+    return mContext.fonsPrewarm(font,
+        scaled(sizes, scaling), scaled(blurs, scaling), ranges);
+}
+
+bool FontStashSystem::loadAtlasCache(const std::filesystem::path &path)
+{
+    return mContext.fonsLoadCache(path) != 0;
+}
+
+bool FontStashSystem::saveAtlasCache(const std::filesystem::path &path)
+{
+    return mContext.fonsSaveCache(path) != 0;
+}
+
+bool FontStashSystem::loadBakedAtlas(const std::string &locator)
+{
+    mBakedAtlas = mGame->assets()->res<FontAtlasAssetConverter>(locator);
+    return mContext.fonsLoadBase(
+        (const unsigned char *)mBakedAtlas->data(),
+        mBakedAtlas->size()) != 0;
+}
 }
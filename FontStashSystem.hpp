@@ -26,53 +26,115 @@ class FontStashSystem final
     >
 {
     Game *mGame = nullptr;
+    // draw one instance per glyph instead of six vertices
+    const bool mInstanced;
+    // render distance fields that are shared by all text sizes
+    const bool mSdf;
 
     std::shared_ptr<GraphicsPipeline> mPipeline;
+    // composites shadows under instanced text
+    std::shared_ptr<GraphicsPipeline> mShadowedPipeline;
     std::shared_ptr<GpuCommandPool> mCommandPool;
-    std::shared_ptr<GpuBuffer> mPosBuffer;
-    std::shared_ptr<GpuBuffer> mTexCoordsBuffer;
-    std::shared_ptr<GpuBuffer> mColorBuffer;
-    std::shared_ptr<GpuImage> mFontTexture;
-    std::shared_ptr<GpuImageView> mFontTextureView;
+    // persistently mapped, FONScontext writes vertices and instances
+    // directly into it through mStreamRing
+    std::shared_ptr<GpuBuffer> mStreamBuffer;
+    FONSring mStreamRing;
+    // command lists of the frames streamed into the ring that may not
+    // have finished, oldest first. the device keeps a submitted command
+    // list alive until the gpu is done with it, so a released one marks
+    // its frame as finished.
+    std::deque<std::pair<int, std::weak_ptr<GraphicsCommandList>>>
+        mPendingFrames;
+    int mCompletedFrame = -1;
+    // fallbacks for batches that don't fit into the ring
+    std::shared_ptr<GpuBuffer> mVertexBuffer;
+    std::shared_ptr<GpuBuffer> mInstanceBuffer;
+    // one texture per atlas layer, each batch samples one of them.
+    // growing the atlas adds a texture instead of copying the old one.
+    std::vector<std::shared_ptr<GpuImage>> mFontTextures;
+    std::vector<std::shared_ptr<GpuImageView>> mFontTextureViews;
     std::shared_ptr<GpuSampler> mFontSampler;
+    // tightly packed copy of the atlas subregion being uploaded
+    std::vector<unsigned char> mUploadScratch;
     mutable std::shared_ptr<GraphicsCommandList> mCurrentCmdList;
+    Vector2f mTargetSize;
 
     FONScontext mContext;
+    // baked glyphs, loaded again whenever the atlas is reset
+    std::shared_ptr<std::string> mBakedAtlas;
     float mLastScaling = mScalingFunc();
 
     // the following dispatching functions all returns non-zeros when succeed
 
     // create texture, only called once during init
     static int dispatchRenderCreate(void *user_ptr, int width, int height);
-    // resize texture, called when expanding texture atlas
+    // recreate the texture, called when the atlas is reset
     static int dispatchRenderResize(void *user_ptr, int width, int height);
-    // update texture subregion, called during command flushing
-    static void dispatchRenderUpdate(
+    // add a texture for a new atlas layer, called when the atlas is full
+    static int dispatchRenderAddPage(void *user_ptr, int layer);
+    // update a list of texture subregions, called during command flushing
+    static void dispatchRenderUpdateRects(
         void *user_ptr,
-        int *rect,
+        int layer,
+        const int *rects,
+        int num_rects,
         const unsigned char *data);
     // flush drawing commands
     static void dispatchRenderDraw(
         void *user_ptr,
-        const float *vertices,
-        const float *tex_coords,
-        const unsigned int *colors,
+        const FONSvertex *vertices,
         int num_vertices);
+    // flush drawing commands when using instanced rendering
+    static void dispatchRenderDrawInstanced(
+        void *user_ptr,
+        const FONSglyphInstance *instances,
+        int num_instances);
+    // flush drawing commands of text with a shadow in sdf mode
+    static void dispatchRenderDrawShadowed(
+        void *user_ptr,
+        const FONSshadowedGlyphInstance *instances,
+        int num_instances);
     // destroy texture atlas, called during system destruction
     static void dispatchRenderDelete(void *user_ptr);
+    // newest frame of the stream ring the gpu has finished
+    static int dispatchCompletedFrame(void *user_ptr);
 
     int renderCreate(int width, int height);
     int renderResize(int width, int height);
-    void renderUpdate(int *rect, const unsigned char *data);
+    int renderAddPage(int layer);
+    void renderUpdateRects(
+        int layer,
+        const int *rects,
+        int num_rects,
+        const unsigned char *data);
     void renderDraw(
-        const float *vertices,
-        const float *tex_coords,
-        const unsigned int *colors,
+        const FONSvertex *vertices,
         int num_vertices);
+    void renderDrawInstanced(
+        const FONSglyphInstance *instances,
+        int num_instances);
+    void renderDrawShadowed(
+        const FONSshadowedGlyphInstance *instances,
+        int num_instances);
     void renderDelete();
+    int completedFrame();
+
+    std::shared_ptr<GraphicsPipeline> compilePipeline(bool shadowed);
+    void addLayerTexture(int width, int height);
+    // binds the pipeline with the push constants
+    void bindPipeline(const std::shared_ptr<GraphicsPipeline> &pipeline);
+    // binds the texture of the atlas layer sampled by the next batch
+    void bindLayer(int layer);
 
 public:
-    explicit FontStashSystem(Game *game);
+    // distance fields need the stb_truetype backend, init throws without
+    // it. with async new glyphs show up a frame late rather than stalling
+    // the frame.
+    explicit FontStashSystem(
+        Game *game,
+        bool instanced = true,
+        bool sdf = false,
+        bool async = true);
     ~FontStashSystem();
 
     const std::type_info & type() override
@@ -86,5 +148,26 @@ public:
     std::shared_ptr<GraphicsCommandList> render(const Clock &clock) override;
 
     int addFont(std::string name, const std::filesystem::path &path);
+    // rasterize glyphs ahead of time, e.g. on loading screens. sizes and
+    // blurs are in the same units as FontStashComponent and get scaled
+    // like it. without distance fields a change of scaling drops them.
+    int prewarm(
+        int font,
+        const std::vector<float> &sizes,
+        const std::vector<float> &blurs,
+        std::u32string_view chars);
+    int prewarm(
+        int font,
+        const std::vector<float> &sizes,
+        const std::vector<float> &blurs,
+        const std::vector<std::pair<char32_t, char32_t>> &ranges);
+    // keep the atlas across runs. load after adding the same fonts the
+    // cache was saved with, returns false if the cache cannot be used.
+    bool loadAtlasCache(const std::filesystem::path &path);
+    bool saveAtlasCache(const std::filesystem::path &path);
+    // start from an atlas baked by FontAtlasAssetConverter. it must have
+    // been baked at the atlas size of the system, scaled for the current
+    // resolution and with the same sdf setting.
+    bool loadBakedAtlas(const std::string &locator);
 };
 }